@@ -5,460 +5,6081 @@
  * used only a mutex to synchronize access to the shared alarm
  * list. This version adds a condition variable. The alarm
  * thread waits on this condition variable, with a timeout that
- * corresponds to the earliest timer request. If the main thread
- * enters an earlier timeout, it signals the condition variable
- * so that the alarm thread will wake up and process the earlier
- * timeout first, requeueing the later request.
+ * corresponds to the earliest timer request. The main thread
+ * parses commands and submits them to the alarm thread through a
+ * lock-free queue, signalling the condition variable when the
+ * queue was empty, so that the alarm thread wakes up and files
+ * the new request. The alarm thread alone owns the pending alarms.
+ *
+ * Pending alarms are held by a scheduling backend: a binary heap
+ * (the default) or a hierarchical timing wheel, selected with
+ * "-b heap" or "-b wheel". With "-f file", commands are read from
+ * the file in large blocks and submitted in batches, without a
+ * prompt, and the program runs until every alarm has expired.
+ *
+ * With "-j shards", the pending alarms are split between several
+ * alarm threads, each with a scheduler, submit queue, mutex and
+ * condition variable of its own; see "Shards" below. On Linux,
+ * "-w epoll" makes the alarm threads sleep in epoll_wait() on a
+ * timerfd and an eventfd instead; see "Event wait" below.
  */
+#ifdef __linux__
+#define _GNU_SOURCE /* for CPU affinity */
+#endif
 #include <pthread.h>
 #include <time.h>
 #include "errors.h"
 #include <ctype.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <sys/un.h>
+#include <netdb.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <linux/mempolicy.h>
+#endif
+
+/*
+ * Build configuration.
+ *
+ * Some choices made at run time can instead be fixed when the
+ * program is compiled, so that a build pays nothing for what it
+ * leaves out:
+ *
+ *      -DALARM_SCHED=heap      the only scheduler backend, heap or
+ *                              wheel; "-b" accepts only that one,
+ *                              and its operations are called
+ *                              directly instead of through "sched"
+ *      -DALARM_CLOCK=real      the only clock, real or virtual (see
+ *                              "Clocks"), likewise for "-t"
+ *      -DALARM_NO_STATS        no histograms and no lock counters,
+ *                              and no clock reads to feed them
+ *      -DALARM_SPIN            spin locks instead of mutexes for the
+ *                              alarm pool and the intern table,
+ *                              which only hold a lock for a few
+ *                              instructions
+ *      -DDEBUG                 print the scheduler's alarms after
+ *                              every insert
+ */
+#ifdef ALARM_NO_STATS
+#define STATS_ON 0
+#else
+#define STATS_ON 1
+#endif
+
+/*
+ * Alarm times are nanoseconds on CLOCK_MONOTONIC, which, unlike
+ * time(), is not moved when someone sets the wall clock.
+ */
+#define NSEC_PER_SEC 1000000000LL
+
+/*
+ * The "alarm" structure now contains the expiration time (on
+ * CLOCK_MONOTONIC, in nanoseconds) for each alarm, so that they
+ * can be sorted. Storing the requested delay would not be
+ * enough, since the "alarm thread" cannot tell how long it has
+ * been on the list. "delay" is kept only to be printed.
+ *
+ * "index" is the alarm's current position in the scheduler: its
+ * slot in the alarm heap, or its wheel level and slot. "link" and
+ * "prev" chain the alarms that share a wheel slot. "seq" is the
+ * order in which the alarm was accepted, which keeps alarms with
+ * the same expiration time in first-come, first-served order.
+ * "hash_next" chains the message number index, and "type_next"
+ * and "type_prev" link the alarms of one message type in their
+ * shard's "tlist". A periodic alarm expires every "period"
+ * nanoseconds, until "until" if that is not 0; it stays in the
+ * scheduler between expirations.
+ *
+ * The fields that the scheduler and the message number index
+ * look at come first and fill one cache line, so walking a wheel
+ * slot or a hash chain reads nothing but that line. "message" is
+ * a message of up to ALARM_MESSAGE - 1 bytes: a short one is kept
+ * in "text", which fills out the alarm's last cache line, and a
+ * long one is shared with every other alarm that says the same
+ * thing (see "Message storage").
+ */
+#define ALARM_MESSAGE 128
+#define ALARM_INLINE 56
+
+typedef struct alarm_tag
+{
+  int64_t time; /* CLOCK_MONOTONIC nanoseconds */
+  unsigned long seq;
+  struct alarm_tag *link;
+  struct alarm_tag *prev;
+  struct alarm_tag *hash_next;
+  struct msgtype_tag *mtype;
+  int messageNumber;
+  int messageType;
+  int index;
+  char type;
+  unsigned char node; /* of the pool it came from */
+  /* Fields below are not used to schedule or look up the alarm */
+  struct alarm_tag *type_next;
+  struct alarm_tag *type_prev;
+  struct typelist_tag *tlist;
+  struct bulk_tag *bulk; /* for a bulk Cancel or Reschedule */
+  int64_t delay;
+  int64_t period;
+  int64_t until; /* CLOCK_MONOTONIC nanoseconds */
+  int length;          /* of the message */
+  bool evicts;         /* filing it must evict another alarm */
+  bool probe;          /* admitted only if it replaces an alarm */
+  const char *message; /* "text", an interned string, or NULL */
+  char text[ALARM_INLINE];
+} alarm_t;
+
+/*
+ * A display thread, started by a Create_Thread request, prints the
+ * expired alarms of one message type. The alarm thread hands it
+ * alarms through "queue", chained through "link" and protected by
+ * the worker's own mutex, so that alarms of different types are
+ * printed in parallel. "paused" parks the worker on its condition
+ * variable, while its alarms keep piling up, in order, on the
+ * queue. "busy" is set while the worker prints a batch it has
+ * taken off the queue, and "drained" is broadcast whenever it has
+ * nothing left it is going to print. "batches" has one entry per
+ * shard: "head" and "tail" collect the alarms of one expiry pass
+ * of that shard's alarm thread and "next" links the workers that
+ * have such a batch; only that alarm thread uses the entry.
+ */
+typedef struct worker_batch_tag
+{
+  alarm_t *head;
+  alarm_t **tail;
+  struct worker_tag *next;
+} worker_batch_t;
+
+typedef struct worker_tag
+{
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  pthread_cond_t drained;
+  alarm_t *queue;
+  alarm_t **queue_tail;
+  worker_batch_t *batches;
+  int messageType;
+  bool paused;
+  bool busy;
+} worker_t;
+
+/*
+ * One record per message type ever used, in the type registry,
+ * which is shared by every shard and protected by type_lock.
+ * "count" is the number of Type A alarms of the type that have
+ * been submitted and not yet expired, cancelled or replaced; it is
+ * counted up when the alarm is submitted, so that a Create_Thread
+ * request sees it even before the alarm's shard has filed it.
+ * "worker" is the type's display thread, if a Create_Thread
+ * request has started one, and "paused" records an accepted
+ * Pause_Thread request. Records are never freed, so that alarms
+ * and shards can keep pointers to them without holding the lock.
+ */
+typedef struct msgtype_tag
+{
+  struct msgtype_tag *hash_next;
+  int messageType;
+  atomic_int count;
+  worker_t *_Atomic worker;
+  bool paused;
+} msgtype_t;
+
+/*
+ * A shard's list of its own pending alarms of one message type.
+ */
+typedef struct typelist_tag
+{
+  struct typelist_tag *hash_next;
+  int messageType;
+  int count;
+  alarm_t *alarms;
+} typelist_t;
+
+/*
+ * A bulk Cancel or Reschedule request, copied to every shard. Each
+ * shard's alarm thread applies it to its own alarms of one message
+ * type ("scope" 'T') or with times from "from" to "to" ('W'), all
+ * in one pass, adds how many it found to "matched", and the last
+ * of them ("shards" counts down) reports the total and frees it.
+ * A Reschedule moves each alarm by "delta".
+ */
+typedef struct bulk_tag
+{
+  char type;
+  char scope;
+  int messageType;
+  int64_t issued;
+  int64_t from;
+  int64_t to;
+  int64_t delta;
+  atomic_int shards;
+  atomic_int matched;
+} bulk_t;
+
+/*
+ * A growable array of alarms, for the results of a scheduler's
+ * "range".
+ */
+typedef struct alarm_vec_tag
+{
+  alarm_t **items;
+  int count;
+  int size;
+} alarm_vec_t;
+
+/*
+ * A scheduling backend holds the pending alarms for an alarm
+ * thread, in a queue made by "create". "next_time" returns the
+ * time at which the alarm thread must next look at the queue (0
+ * if it is empty), "due" returns one alarm whose time is not
+ * after "now", or NULL if none is due, leaving it to be removed or
+ * given a new time with "retime", which moves it within the queue,
+ * "first"/"next" walk every pending alarm in no particular order,
+ * and "range" appends to "found" every alarm whose time is from
+ * "from" to "to", without changing the queue.
+ */
+typedef struct sched_ops_tag
+{
+  const char *name;
+  void *(*create)(void);
+  void (*insert)(void *queue, alarm_t *alarm);
+  void (*remove)(void *queue, alarm_t *alarm);
+  int64_t (*next_time)(void *queue);
+  alarm_t *(*due)(void *queue, int64_t now);
+  void (*retime)(void *queue, alarm_t *alarm, int64_t time);
+  alarm_t *(*first)(void *queue);
+  alarm_t *(*next)(void *queue, alarm_t *alarm);
+  void (*range)(void *queue, int64_t from, int64_t to, alarm_vec_t *found);
+} sched_ops_t;
+
+/*
+ * Why an alarm thread woke up: a timed wait ran out and there was
+ * work ("timer"), a command was submitted ("submit"), a submitted
+ * alarm moved the next deadline earlier ("preempt", also counted
+ * as a submit), or nothing at all had changed ("spurious"). They
+ * are written only by the shard's alarm thread and printed with
+ * "-v".
+ */
+typedef struct wake_stats_tag
+{
+  atomic_ulong timer;
+  atomic_ulong submit;
+  atomic_ulong preempt;
+  atomic_ulong spurious;
+} wake_stats_t;
+
+/*
+ * Records waiting to be written to a durable file; see
+ * "Durability".
+ */
+typedef struct record_out_tag
+{
+  int fd;
+  char *buffer; /* RECORD_BUFFER bytes */
+  size_t used;
+  int64_t bytes;  /* written to "fd" so far */
+  int64_t offset; /* clock_offset(), for the deadlines */
+} record_out_t;
+
+/*
+ * An entry of a shard's eviction heap (see "Admission control").
+ */
+typedef struct evict_entry_tag
+{
+  int64_t time;
+  unsigned long seq;
+  alarm_t *alarm;
+} evict_entry_t;
+
+/*
+ * Shards.
+ *
+ * Each shard has an alarm thread of its own, which alone owns the
+ * shard's scheduler queue, its message number index, and its
+ * per-type alarm lists ("type_index"). Type A requests and Cancel
+ * requests go to the shard chosen by a hash of their
+ * messageNumber, so a replacement or a cancel always finds the
+ * alarm it refers to in its own shard. Create_Thread,
+ * Pause_Thread, Resume_Thread and Stats requests, which deal with
+ * the shared type registry, all go to shard 0.
+ *
+ * Ordering: the requests for one shard are carried out in the
+ * order they were submitted, so with one shard, the default, every
+ * request is carried out in order, exactly as it was before there
+ * were shards. Within a messageType, the alarms of one shard are
+ * delivered in order of expiration time, and those with the same
+ * time in the order they were accepted; alarms of one type that
+ * are in different shards are each delivered when they are due,
+ * so two whose times are closer together than the shards' wakeup
+ * lateness may be delivered in either order.
+ *
+ * Commands are submitted to a shard on "submit_head", a lock-free
+ * stack linked through "link". Producers push with a
+ * compare-and-swap; the alarm thread takes the whole stack with
+ * one exchange and reverses it into submission order. A producer
+ * whose push finds the stack empty signals the shard's "cond",
+ * holding its "mutex", and the alarm thread only ever sleeps on
+ * "cond" after seeing an empty stack while holding "mutex", so no
+ * wakeup is lost and pushes onto a non-empty stack take no lock.
+ * "submit_head" has a cache line to itself, since every producer
+ * writes it.
+ *
+ * When the input has run out, the input thread sets "input_done"
+ * in every shard and waits on its "idle_cond" until the shard's
+ * alarm thread has carried out every command, and, if
+ * "wait_alarms", has no alarm left either, and sets "idle"; all
+ * four are protected by "mutex". "pending", "peak", "inserted"
+ * and "expired" mirror the shard's counts for Stats. In benchmark
+ * mode, "bench_carried" is when the alarm thread last carried out
+ * submitted commands. The descriptors and "armed" are used only
+ * with "-w epoll", in place of "cond". "found" holds the alarms a
+ * bulk request applies to while it is carried out. "wal" is the
+ * shard's log, with "-d". "cpu" is the CPU its alarm thread is
+ * kept to, or -1, and "node" that CPU's NUMA node (see
+ * "Placement").
+ */
+typedef struct shard_tag
+{
+  alarm_t *_Atomic submit_head;
+  _Alignas(64) pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  pthread_cond_t idle_cond;
+  bool input_done;
+  bool wait_alarms;
+  bool idle;
+  int id;
+  int cpu;
+  int node;
+  pthread_t thread;
+  void *queue;
+  unsigned long seq;
+  int count;
+  alarm_t **number_index;
+  int number_bits;
+  int number_count;
+  typelist_t **type_index;
+  int type_bits;
+  int type_count;
+  atomic_int pending;
+  atomic_int peak;
+  atomic_ulong inserted;
+  atomic_ulong expired;
+  wake_stats_t wake;
+  int64_t bench_carried;
+  int epoll_fd;
+  int timer_fd;
+  int event_fd;
+  int64_t armed;
+  alarm_vec_t found;
+  record_out_t *wal;
+  atomic_ulong wal_syncs;
+  long released;
+  long released_bytes;
+  evict_entry_t *evict;
+  int evict_count;
+  int evict_size;
+} shard_t;
+
+#define SHARD_MAX 256
+
+shard_t **shards = NULL;
+int shard_count = 1;
+
+/*
+ * In benchmark mode, the alarm threads record in "bench_lateness"
+ * how late each alarm expired, instead of printing it.
+ */
+int64_t *bench_lateness = NULL;
+atomic_int bench_expired;
+
+bool verbose = false;
+bool wait_epoll = false;
+
+/*
+ * With "-c seconds", an alarm thread lets its earliest alarm wait
+ * up to "coalesce" nanoseconds, and then takes every alarm that is
+ * due by then in the same pass, so that alarms whose deadlines are
+ * close together are delivered together. No alarm expires early,
+ * or later than "coalesce" after its time.
+ */
+int64_t coalesce = 0;
+
+/*
+ * Admission control.
+ *
+ * "admitted" counts the Type A alarms that have been accepted and
+ * have not yet expired for good, been cancelled or been replaced,
+ * including those still on their way to a shard, and
+ * "admitted_bytes" the bytes of their messages. With "-m alarms"
+ * or "-M bytes", a request that would take either past its limit
+ * is dealt with as "-a" says: the submitting thread waits for room
+ * ("block", the default), the request is refused with an error
+ * line ("reject"), or it is accepted and the shard that files it
+ * then evicts its own alarm with the farthest deadline, which may
+ * be the new one ("evict"). An alarm thread counts what it
+ * releases in its shard and takes it off the totals once a pass,
+ * so that expiring an alarm touches no shared cache line.
+ *
+ * For "evict", each shard keeps a heap of its alarms by latest
+ * time first, with an entry added whenever an alarm is filed or
+ * given a new time. Entries are not removed when their alarm
+ * leaves or moves; one whose alarm is no longer pending in the
+ * shard with the same "seq" is simply skipped, and the heap is
+ * rebuilt from the live entries when it holds twice as many as
+ * the shard has alarms. This costs nothing unless "evict" is in
+ * use.
+ *
+ * Under "block", a request that only replaces a pending alarm adds
+ * nothing but the difference in message length, so waiting for room
+ * could stall the input for an alarm that takes none. Only the
+ * message number's shard knows whether it is pending, so before
+ * waiting, the submitting thread hands the request to that shard as
+ * a "probe" and waits for the verdict in "admit_verdict": the shard
+ * files a replacement, counting it in, or hands anything else back
+ * to wait for room as usual. One probe is out at a time, while
+ * "admit_probing" is set; both are protected by "admit_mutex".
+ *
+ * "pool_bytes" is the memory the alarm pool has taken, and
+ * "intern_bytes" that of the arenas holding the "interned" long
+ * messages.
+ */
+#define ADMIT_BLOCK 0
+#define ADMIT_REJECT 1
+#define ADMIT_EVICT 2
+
+long admit_limit = 0;
+long admit_byte_limit = 0;
+int admit_policy = ADMIT_BLOCK;
+atomic_long admitted;
+atomic_long admitted_bytes;
+atomic_long pool_bytes;
+atomic_long intern_bytes;
+atomic_long interned;
+atomic_int admit_waiters;
+pthread_mutex_t admit_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t admit_cond = PTHREAD_COND_INITIALIZER;
+bool admit_probing = false;
+int admit_verdict;
+
+/*
+ * Count one event. Each counter has a single writer, so a relaxed
+ * load and store is enough, and cheaper than an atomic add.
+ */
+static void counter_bump(atomic_ulong *counter)
+{
+  atomic_store_explicit(counter,
+                        atomic_load_explicit(counter, memory_order_relaxed) + 1,
+                        memory_order_relaxed);
+}
+
+/*
+ * Clocks.
+ *
+ * Alarm times are read from a clock backend, selected with "-t":
+ * "real", the default, is CLOCK_MONOTONIC, and "virtual" is a
+ * simulated clock that jumps straight to the next deadline instead
+ * of waiting for it. The virtual clock stands still at the time the
+ * program started for as long as commands are being read, so every
+ * request is timed from the same instant. Once the input has run
+ * out, or is waiting for room under an admission limit, an alarm
+ * thread that would sleep until its next deadline moves its own
+ * copy of the clock there instead, so alarms spread over days
+ * expire as fast as the scheduler can take them off, in the order
+ * they would in real time. Each shard keeps its own time,
+ * since nothing a shard does depends on another shard's clock.
+ *
+ * "skip" is NULL for a clock that moves by itself. Otherwise it is
+ * called, holding the shard's mutex and with nothing submitted, by
+ * an alarm thread that is about to wait for "wake"; it returns true
+ * once it has moved the thread's clock to "wake", or false if the
+ * thread must wait for a command instead. "offset" is
+ * CLOCK_REALTIME minus the clock, for showing and storing times.
+ *
+ * How long something takes, for the histograms and the benchmark,
+ * is always measured with clock_real().
+ */
+typedef struct clock_ops_tag
+{
+  const char *name;
+  int64_t (*now)(void);
+  int64_t (*offset)(void);
+  bool (*skip)(shard_t *shard, int64_t wake);
+} clock_ops_t;
+
+/*
+ * Read CLOCK_MONOTONIC, in nanoseconds.
+ */
+int64_t clock_real(void)
+{
+  struct timespec now;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &now) != 0)
+    errno_abort("Read clock");
+  return (int64_t)now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+static int64_t real_offset(void)
+{
+  struct timespec now;
+
+  if (clock_gettime(CLOCK_REALTIME, &now) != 0)
+    errno_abort("Read clock");
+  return (int64_t)now.tv_sec * NSEC_PER_SEC + now.tv_nsec - clock_real();
+}
+
+const clock_ops_t clock_real_ops = {"real", clock_real, real_offset, NULL};
+
+/*
+ * The virtual clock starts at "virtual_start", the real time at
+ * which it was chosen, with "virtual_wall" the real clock's
+ * offset then. "virtual_local" is the calling alarm thread's own
+ * time, or 0 until it first skips ahead.
+ */
+int64_t virtual_start;
+int64_t virtual_wall;
+__thread int64_t virtual_local;
+
+static int64_t virtual_now(void)
+{
+  return virtual_local != 0 ? virtual_local : virtual_start;
+}
+
+static int64_t virtual_offset(void)
+{
+  return virtual_wall;
+}
+
+static bool virtual_skip(shard_t *shard, int64_t wake)
+{
+  if (!shard->input_done && atomic_load(&admit_waiters) == 0)
+    return false;
+  virtual_local = wake;
+  return true;
+}
+
+const clock_ops_t clock_virtual_ops = {"virtual", virtual_now, virtual_offset, virtual_skip};
+
+/*
+ * The clock in use, chosen with "-t" or fixed with "-DALARM_CLOCK",
+ * as "sched" is.
+ */
+#define CLOCK_OPS_OF(name) clock_##name##_ops
+#define CLOCK_OPS(name) CLOCK_OPS_OF(name)
+#ifdef ALARM_CLOCK
+const clock_ops_t *const clock_source = &CLOCK_OPS(ALARM_CLOCK);
+const clock_ops_t *const clock_sources[] = {&CLOCK_OPS(ALARM_CLOCK), NULL};
+#define clock_choose(ops) ((void)(ops))
+#else
+const clock_ops_t *clock_source = &clock_real_ops;
+const clock_ops_t *const clock_sources[] = {&clock_real_ops, &clock_virtual_ops, NULL};
+#define clock_choose(ops) ((void)(clock_source = (ops)))
+#endif
+
+/*
+ * Start the virtual clock from now, whether or not it is used.
+ */
+void clock_init(void)
+{
+  virtual_start = clock_real();
+  virtual_wall = real_offset();
+}
+
+/*
+ * Read the alarm clock, in nanoseconds.
+ */
+int64_t clock_now(void)
+{
+  return clock_source->now();
+}
+
+/*
+ * CLOCK_REALTIME minus the alarm clock: added to an alarm time to
+ * store or show it, subtracted to load it.
+ */
+int64_t clock_offset(void)
+{
+  return clock_source->offset();
+}
+
+/*
+ * The time of day, in seconds, on the alarm clock, for the
+ * messages that say when a request was carried out.
+ */
+long long clock_time(void)
+{
+  return (clock_now() + clock_offset()) / NSEC_PER_SEC;
+}
+
+/*
+ * Parse a non-negative number of seconds with up to nine decimal
+ * places, such as "2" or "0.125". Returns a pointer just past the
+ * number, or NULL if the text does not start with such a number.
+ */
+const char *parse_seconds(const char *text, int64_t *ns)
+{
+  int64_t whole = 0, fraction = 0, scale = NSEC_PER_SEC;
+  int digits = 0;
+
+  for (; isdigit(*text); text++)
+  {
+    if (++digits > 9)
+      return NULL;
+    whole = whole * 10 + (*text - '0');
+  }
+  if (digits == 0)
+    return NULL;
+  if (*text == '.')
+    for (text++, digits = 0; isdigit(*text); text++)
+    {
+      if (++digits > 9)
+        return NULL;
+      scale /= 10;
+      fraction += (*text - '0') * scale;
+    }
+  *ns = whole * NSEC_PER_SEC + fraction;
+  return text;
+}
+
+/*
+ * Format a number of nanoseconds as seconds, without trailing
+ * zeros in the fraction: "2", "0.125".
+ */
+void format_seconds(char *buffer, size_t size, int64_t ns)
+{
+  int64_t fraction = ns % NSEC_PER_SEC;
+  int digits = 9;
+
+  if (fraction == 0)
+  {
+    snprintf(buffer, size, "%lld", (long long)(ns / NSEC_PER_SEC));
+    return;
+  }
+  while (fraction % 10 == 0)
+  {
+    fraction /= 10;
+    digits--;
+  }
+  snprintf(buffer, size, "%lld.%0*lld", (long long)(ns / NSEC_PER_SEC),
+           digits, (long long)fraction);
+}
+
+/*
+ * Output sink.
+ *
+ * Everything the program prints on stdout goes through log_printf,
+ * which formats the text straight into a slot of "log_ring", and
+ * is written out by the logger thread, many records to a writev.
+ * No other thread ever waits for the terminal.
+ *
+ * The ring is a bounded multi-producer queue: each slot carries a
+ * sequence number that says whose turn it is. A slot at position
+ * "pos" is free for the producer that claims "pos" when its
+ * sequence is pos, and holds a record for the logger when it is
+ * pos + 1; the logger frees it for the next lap by setting it to
+ * pos + LOG_SLOTS. Producers claim positions by advancing
+ * "log_head" with a compare-and-swap; only the logger moves
+ * "log_tail".
+ *
+ * When the ring is full, a producer either waits for the logger
+ * ("-o block", the default) or drops its record ("-o drop"); the
+ * number dropped is printed with "-v". Threads that wait for the
+ * logger -- producers, and log_flush -- count themselves in
+ * "log_waiters", and the logger sleeps with "log_sleeping" set;
+ * each side sets its flag before looking at the ring again, and
+ * the other looks at the flag after changing the ring, so a
+ * wakeup is never lost.
+ *
+ * A thread that prints a batch of lines brackets them with
+ * log_hold and log_release, so that the logger is woken once, for
+ * the whole batch, and writes it out with one writev rather than
+ * waking for the first line and writing the rest later.
+ */
+#define LOG_SLOTS 4096
+#define LOG_MASK (LOG_SLOTS - 1)
+#define LOG_IOV 64
+
+typedef struct log_record_tag
+{
+  atomic_size_t seq;
+  int length;
+  char text[256 - sizeof(atomic_size_t) - sizeof(int)];
+} log_record_t;
+
+log_record_t log_ring[LOG_SLOTS];
+atomic_size_t log_head;
+atomic_size_t log_tail;
+atomic_bool log_sleeping;
+atomic_int log_waiters;
+atomic_ulong log_dropped;
+atomic_ulong log_lines;
+atomic_ulong log_writes;
+bool log_drop = false;
+bool log_quiet = false;
+pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t log_space = PTHREAD_COND_INITIALIZER;
+__thread bool log_held;
+__thread bool log_unwoken;
+
+/*
+ * Wake the logger if it is waiting for records.
+ */
+static void log_wake(void)
+{
+  int status;
+
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&log_sleeping, memory_order_relaxed))
+  {
+    status = pthread_mutex_lock(&log_mutex);
+    if (status != 0)
+      err_abort(status, "Lock mutex");
+    status = pthread_cond_signal(&log_cond);
+    if (status != 0)
+      err_abort(status, "Signal cond");
+    status = pthread_mutex_unlock(&log_mutex);
+    if (status != 0)
+      err_abort(status, "Unlock mutex");
+  }
+}
+
+/*
+ * Wait on log_space until "done" says the logger has done enough.
+ */
+static void log_wait(bool (*done)(void))
+{
+  int status;
+
+  status = pthread_mutex_lock(&log_mutex);
+  if (status != 0)
+    err_abort(status, "Lock mutex");
+  atomic_fetch_add(&log_waiters, 1);
+  while (!done())
+  {
+    status = pthread_cond_wait(&log_space, &log_mutex);
+    if (status != 0)
+      err_abort(status, "Wait on cond");
+  }
+  atomic_fetch_sub(&log_waiters, 1);
+  status = pthread_mutex_unlock(&log_mutex);
+  if (status != 0)
+    err_abort(status, "Unlock mutex");
+}
+
+static bool log_has_space(void)
+{
+  size_t pos = atomic_load(&log_head);
+
+  return atomic_load(&log_ring[pos & LOG_MASK].seq) == pos;
+}
+
+static bool log_is_empty(void)
+{
+  return atomic_load(&log_tail) == atomic_load(&log_head);
+}
+
+/*
+ * Claim the next slot of the ring, or return NULL if it is full
+ * and records are being dropped.
+ */
+static log_record_t *log_claim(void)
+{
+  log_record_t *record;
+  size_t pos, seq;
+
+  pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+  while (1)
+  {
+    record = &log_ring[pos & LOG_MASK];
+    seq = atomic_load_explicit(&record->seq, memory_order_acquire);
+    if (seq == pos)
+    {
+      if (atomic_compare_exchange_weak(&log_head, &pos, pos + 1))
+        return record;
+    }
+    else if ((ptrdiff_t)(seq - pos) < 0)
+    {
+      if (log_drop)
+      {
+        atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+        return NULL;
+      }
+      log_unwoken = false;
+      log_wake(); /* in case it was held off */
+      log_wait(log_has_space);
+      pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+    }
+    else
+      pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+  }
+}
+
+/*
+ * Format a line of output into the ring. Text that does not fit
+ * in a record is truncated. This may be called from any thread.
+ */
+void log_printf(const char *format, ...)
+{
+  log_record_t *record;
+  va_list args;
+  size_t pos;
+  int length;
+
+  if (log_quiet)
+    return;
+  record = log_claim();
+  if (record == NULL)
+    return;
+  pos = atomic_load_explicit(&record->seq, memory_order_relaxed);
+  va_start(args, format);
+  length = vsnprintf(record->text, sizeof(record->text), format, args);
+  va_end(args);
+  if (length < 0)
+    length = 0;
+  else if (length >= (int)sizeof(record->text))
+    length = sizeof(record->text) - 1;
+  record->length = length;
+  atomic_store_explicit(&record->seq, pos + 1, memory_order_release);
+  if (log_held)
+    log_unwoken = true;
+  else
+    log_wake();
+}
+
+/*
+ * Hold off waking the logger for what this thread prints until
+ * log_release.
+ */
+void log_hold(void)
+{
+  log_held = true;
+}
+
+void log_release(void)
+{
+  log_held = false;
+  if (log_unwoken)
+  {
+    log_unwoken = false;
+    log_wake();
+  }
+}
+
+/*
+ * Write out "count" records, starting with the one "iov" begins
+ * with, allowing for short writes.
+ */
+static void log_write(struct iovec *iov, int count)
+{
+  ssize_t written;
+
+  while (count > 0)
+  {
+    written = writev(1, iov, count);
+    if (written < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      errno_abort("Write output");
+    }
+    for (; count > 0 && (size_t)written >= iov->iov_len; iov++, count--)
+      written -= iov->iov_len;
+    if (count > 0)
+    {
+      iov->iov_base = (char *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+}
+
+/*
+ * The logger thread's start routine.
+ */
+void *log_thread(void *arg)
+{
+  struct iovec iov[LOG_IOV];
+  log_record_t *record;
+  size_t tail = 0;
+  int count, i, status;
+
+  (void)arg;
+
+  while (1)
+  {
+    for (count = 0; count < LOG_IOV; count++)
+    {
+      record = &log_ring[(tail + count) & LOG_MASK];
+      if (atomic_load_explicit(&record->seq, memory_order_acquire) != tail + count + 1)
+        break;
+      iov[count].iov_base = record->text;
+      iov[count].iov_len = record->length;
+    }
+    if (count == 0)
+    {
+      status = pthread_mutex_lock(&log_mutex);
+      if (status != 0)
+        err_abort(status, "Lock mutex");
+      atomic_store(&log_sleeping, true);
+      if (atomic_load(&log_ring[tail & LOG_MASK].seq) != tail + 1)
+      {
+        status = pthread_cond_wait(&log_cond, &log_mutex);
+        if (status != 0)
+          err_abort(status, "Wait on cond");
+      }
+      atomic_store(&log_sleeping, false);
+      status = pthread_mutex_unlock(&log_mutex);
+      if (status != 0)
+        err_abort(status, "Unlock mutex");
+      continue;
+    }
+    log_write(iov, count);
+    atomic_fetch_add_explicit(&log_lines, count, memory_order_relaxed);
+    atomic_fetch_add_explicit(&log_writes, 1, memory_order_relaxed);
+    for (i = 0; i < count; i++, tail++)
+      atomic_store_explicit(&log_ring[tail & LOG_MASK].seq, tail + LOG_SLOTS,
+                            memory_order_release);
+    atomic_store(&log_tail, tail);
+    if (atomic_load(&log_waiters) > 0)
+    {
+      status = pthread_mutex_lock(&log_mutex);
+      if (status != 0)
+        err_abort(status, "Lock mutex");
+      status = pthread_cond_broadcast(&log_space);
+      if (status != 0)
+        err_abort(status, "Broadcast cond");
+      status = pthread_mutex_unlock(&log_mutex);
+      if (status != 0)
+        err_abort(status, "Unlock mutex");
+    }
+  }
+}
+
+void log_init(void)
+{
+  pthread_t thread;
+  size_t i;
+  int status;
+
+  for (i = 0; i < LOG_SLOTS; i++)
+    atomic_init(&log_ring[i].seq, i);
+  status = pthread_create(&thread, NULL, log_thread, NULL);
+  if (status != 0)
+    err_abort(status, "Create logger thread");
+}
+
+/*
+ * Wait until everything logged so far has been written.
+ */
+void log_flush(void)
+{
+  log_wait(log_is_empty);
+}
+
+/*
+ * Statistics.
+ *
+ * Each thread records what it measures in a thread_stats_t of its
+ * own, allocated the first time it records anything and linked on
+ * "stats_threads", so recording is a few plain stores with no
+ * shared cache line and no atomic read-modify-write. A Stats
+ * command, SIGUSR1, or the period given with "-S" has the alarm
+ * thread merge every thread's records and print them.
+ *
+ * Latencies go into log-linear histograms, as HdrHistogram does:
+ * values below HIST_SUB are counted exactly, and above that each
+ * power of two is split into HIST_SUB buckets, so that any value
+ * is recorded to within 1/HIST_SUB of itself, from nanoseconds up
+ * to centuries, in a fixed HIST_BUCKETS counters.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct histogram_tag
+{
+  atomic_ulong count[HIST_BUCKETS];
+} histogram_t;
+
+typedef struct thread_stats_tag
+{
+  struct thread_stats_tag *next;
+  histogram_t insert;   /* alarm_insert(), in the alarm thread */
+  histogram_t lateness; /* expiry after alarm->time */
+  histogram_t lock_wait;
+  histogram_t lock_hold;
+} thread_stats_t;
+
+pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+thread_stats_t *stats_threads = NULL;
+__thread thread_stats_t *stats_self = NULL;
+
+static int hist_bucket(uint64_t value)
+{
+  int top;
+
+  if (value < HIST_SUB)
+    return value;
+  top = 63 - __builtin_clzll(value);
+  return ((top - HIST_SUB_BITS + 1) << HIST_SUB_BITS) |
+         ((value >> (top - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/*
+ * The smallest value counted in a bucket.
+ */
+static uint64_t hist_value(int bucket)
+{
+  int range = bucket >> HIST_SUB_BITS;
+
+  if (range == 0)
+    return bucket;
+  return (uint64_t)(HIST_SUB + (bucket & (HIST_SUB - 1))) << (range - 1);
+}
+
+static thread_stats_t *stats_get(void)
+{
+  thread_stats_t *stats = stats_self;
+  int status;
+
+  if (stats != NULL)
+    return stats;
+  stats = calloc(1, sizeof(thread_stats_t));
+  if (stats == NULL)
+    errno_abort("Allocate statistics");
+  status = pthread_mutex_lock(&stats_mutex);
+  if (status != 0)
+    err_abort(status, "Lock mutex");
+  stats->next = stats_threads;
+  stats_threads = stats;
+  status = pthread_mutex_unlock(&stats_mutex);
+  if (status != 0)
+    err_abort(status, "Unlock mutex");
+  stats_self = stats;
+  return stats;
+}
+
+/*
+ * Record a value, in nanoseconds, in one of this thread's
+ * histograms; negative values count as 0.
+ */
+#define stats_record(field, value)               \
+  do                                             \
+  {                                              \
+    if (STATS_ON)                                \
+      hist_add(&stats_get()->field, (value));    \
+  } while (0)
+
+/*
+ * Read the clock for a histogram, or not at all without them.
+ */
+#define stats_clock() (STATS_ON ? clock_real() : 0)
+
+static void hist_add(histogram_t *histogram, int64_t value)
+{
+  counter_bump(&histogram->count[hist_bucket(value < 0 ? 0 : value)]);
+}
+
+/*
+ * How often a mutex was locked, and how often another thread
+ * already held it; reported by the benchmark mode. How long the
+ * lock was waited for and held goes into the lock_wait and
+ * lock_hold histograms: mutex_lock() returns the time at which
+ * the lock was taken, to be handed to mutex_unlock().
+ */
+typedef struct lock_stats_tag
+{
+  atomic_ulong taken;
+  atomic_ulong contended;
+} lock_stats_t;
+
+lock_stats_t alarm_lock_stats;
+lock_stats_t pool_lock_stats;
+atomic_ulong submit_retries;
+
+#define lock_count(counter)                                          \
+  do                                                                 \
+  {                                                                  \
+    if (STATS_ON)                                                    \
+      atomic_fetch_add_explicit((counter), 1, memory_order_relaxed); \
+  } while (0)
+
+/*
+ * Define name_lock() and name_unlock() for one kind of lock, given
+ * its try, lock and unlock functions.
+ */
+#define LOCK_TIMED(name, type, trylock, acquire, release)              \
+  static int64_t name##_lock(type *lock, lock_stats_t *stats)          \
+  {                                                                    \
+    int64_t start = 0;                                                 \
+    int status;                                                        \
+                                                                       \
+    status = trylock(lock);                                            \
+    if (status == EBUSY)                                               \
+    {                                                                  \
+      lock_count(&stats->contended);                                   \
+      start = stats_clock();                                           \
+      status = acquire(lock);                                          \
+    }                                                                  \
+    if (status != 0)                                                   \
+      err_abort(status, "Lock " #name);                                \
+    lock_count(&stats->taken);                                         \
+    stats_record(lock_wait, start == 0 ? 0 : stats_clock() - start);   \
+    return stats_clock();                                              \
+  }                                                                    \
+                                                                       \
+  static void name##_unlock(type *lock, int64_t locked)                \
+  {                                                                    \
+    int status;                                                        \
+                                                                       \
+    stats_record(lock_hold, stats_clock() - locked);                   \
+    status = release(lock);                                            \
+    if (status != 0)                                                   \
+      err_abort(status, "Unlock " #name);                              \
+  }
+
+LOCK_TIMED(mutex, pthread_mutex_t, pthread_mutex_trylock, pthread_mutex_lock,
+           pthread_mutex_unlock)
+
+/*
+ * The "short" locks, those of the alarm pool and of the intern
+ * table, are mutexes, or spin locks with "-DALARM_SPIN".
+ */
+#ifdef ALARM_SPIN
+typedef pthread_spinlock_t short_lock_t;
+LOCK_TIMED(spin, pthread_spinlock_t, pthread_spin_trylock, pthread_spin_lock,
+           pthread_spin_unlock)
+#define short_init(lock) pthread_spin_init((lock), PTHREAD_PROCESS_PRIVATE)
+#define short_acquire pthread_spin_lock
+#define short_release pthread_spin_unlock
+#define short_lock spin_lock
+#define short_unlock spin_unlock
+#else
+typedef pthread_mutex_t short_lock_t;
+#define short_init(lock) pthread_mutex_init((lock), NULL)
+#define short_acquire pthread_mutex_lock
+#define short_release pthread_mutex_unlock
+#define short_lock mutex_lock
+#define short_unlock mutex_unlock
+#endif
+
+/*
+ * Print one merged histogram: the number of values and a few
+ * percentiles, in microseconds.
+ */
+static void hist_print(const char *name, size_t offset)
+{
+  static const int per_mille[] = {500, 900, 990, 999, 1000};
+  static const char *const label[] = {"p50", "p90", "p99", "p999", "max"};
+  unsigned long merged[HIST_BUCKETS] = {0}, total = 0, seen, rank;
+  thread_stats_t *stats;
+  histogram_t *histogram;
+  char line[256];
+  int bucket, i, length;
+
+  for (stats = stats_threads; stats != NULL; stats = stats->next)
+  {
+    histogram = (histogram_t *)((char *)stats + offset);
+    for (bucket = 0; bucket < HIST_BUCKETS; bucket++)
+      merged[bucket] += atomic_load_explicit(&histogram->count[bucket],
+                                             memory_order_relaxed);
+  }
+  for (bucket = 0; bucket < HIST_BUCKETS; bucket++)
+    total += merged[bucket];
+  length = snprintf(line, sizeof(line), "  %-10s %lu", name, total);
+  for (i = 0, bucket = 0, seen = 0; total != 0 && i < 5; i++)
+  {
+    rank = (total - 1) * per_mille[i] / 1000 + 1;
+    while (seen + merged[bucket] < rank)
+      seen += merged[bucket++];
+    length += snprintf(line + length, sizeof(line) - length, ", %s %.3f us",
+                       label[i], hist_value(bucket) / 1e3);
+  }
+  log_printf("%s\n", line);
+}
+
+/*
+ * Print every statistic: the totals over every shard, then, with
+ * more than one shard, each shard's own counts. The peak of the
+ * totals is the sum of the shards' peaks, which need not have
+ * been reached at the same time.
+ */
+void stats_dump(void)
+{
+  unsigned long inserted = 0, expired = 0;
+  int pending = 0, peak = 0, status, i;
+
+  for (i = 0; i < shard_count; i++)
+  {
+    pending += atomic_load(&shards[i]->pending);
+    peak += atomic_load(&shards[i]->peak);
+    inserted += atomic_load(&shards[i]->inserted);
+    expired += atomic_load(&shards[i]->expired);
+  }
+  log_printf("Stats: %d pending (peak %d), %lu inserted, %lu expired\n",
+             pending, peak, inserted, expired);
+  log_printf("  memory     %ld alarms, %ld message bytes, %ld bytes of alarm slabs\n",
+             atomic_load(&admitted), atomic_load(&admitted_bytes), atomic_load(&pool_bytes));
+  log_printf("  messages   %ld interned in %ld bytes of arena\n",
+             atomic_load(&interned), atomic_load(&intern_bytes));
+  for (i = 0; shard_count > 1 && i < shard_count; i++)
+    log_printf("  shard %-4d %d pending (peak %d), %lu inserted, %lu expired\n", i,
+               atomic_load(&shards[i]->pending), atomic_load(&shards[i]->peak),
+               atomic_load(&shards[i]->inserted), atomic_load(&shards[i]->expired));
+  if (!STATS_ON)
+    return;
+  status = pthread_mutex_lock(&stats_mutex);
+  if (status != 0)
+    err_abort(status, "Lock mutex");
+  hist_print("insert", offsetof(thread_stats_t, insert));
+  hist_print("lateness", offsetof(thread_stats_t, lateness));
+  hist_print("lock wait", offsetof(thread_stats_t, lock_wait));
+  hist_print("lock hold", offsetof(thread_stats_t, lock_hold));
+  status = pthread_mutex_unlock(&stats_mutex);
+  if (status != 0)
+    err_abort(status, "Unlock mutex");
+}
+
+/*
+ * Message storage.
+ *
+ * A message shorter than ALARM_INLINE bytes is copied into the
+ * alarm's own "text". A longer one is interned: the table keeps one
+ * copy of each distinct long message, with a count of the alarms
+ * that point at it, so that a million alarms with the same message
+ * hold one copy between them and no alarm has to make room for the
+ * longest message there could be. The table is split by hash into
+ * INTERN_STRIPES stripes, each with its own mutex, chains and
+ * arena. A reference is only taken or dropped under the stripe's
+ * mutex, so a string whose count falls to zero can be unlinked and
+ * reused without racing a thread that has just found it.
+ *
+ * A string's memory is carved from the front of its stripe's
+ * current INTERN_CHUNK byte chunk, in multiples of INTERN_GRAIN
+ * bytes; a released string goes on the stripe's free list for its
+ * size and is the first to be reused at that size. Chunks are
+ * never returned to the system.
+ */
+#define INTERN_STRIPES 64
+#define INTERN_MIN_BITS 4
+#define INTERN_GRAIN 16
+#define INTERN_CHUNK 8192
+#define INTERN_CLASSES \
+  ((offsetof(intern_t, text) + ALARM_MESSAGE + INTERN_GRAIN - 1) / INTERN_GRAIN)
+
+typedef struct intern_tag
+{
+  struct intern_tag *next; /* in its chain, or on a free list */
+  uint32_t hash;
+  int refs;
+  int length;
+  char text[];
+} intern_t;
+
+typedef struct intern_stripe_tag
+{
+  short_lock_t lock;
+  intern_t **chains;
+  int bits;
+  int count;
+  char *arena;
+  size_t left; /* bytes left in "arena" */
+  intern_t *free[INTERN_CLASSES];
+} intern_stripe_t;
+
+intern_stripe_t intern_stripes[INTERN_STRIPES];
+
+void intern_init(void)
+{
+  int status, i;
+
+  for (i = 0; i < INTERN_STRIPES; i++)
+  {
+    status = short_init(&intern_stripes[i].lock);
+    if (status != 0)
+      err_abort(status, "Init intern lock");
+  }
+}
+
+static uint32_t intern_hash(const char *text, size_t length)
+{
+  uint32_t hash = 2166136261u;
+  size_t i;
+
+  for (i = 0; i < length; i++)
+    hash = (hash ^ (unsigned char)text[i]) * 16777619u;
+  return hash;
+}
+
+/*
+ * The chain of a stripe that holds strings with this hash; the low
+ * bits of the hash already chose the stripe.
+ */
+static intern_t **intern_chain(intern_stripe_t *stripe, uint32_t hash)
+{
+  return &stripe->chains[(hash / INTERN_STRIPES) & ((1u << stripe->bits) - 1)];
+}
+
+static void intern_lock(intern_stripe_t *stripe)
+{
+  int status;
+
+  status = short_acquire(&stripe->lock);
+  if (status != 0)
+    err_abort(status, "Lock intern stripe");
+}
+
+static void intern_unlock(intern_stripe_t *stripe)
+{
+  int status;
+
+  status = short_release(&stripe->lock);
+  if (status != 0)
+    err_abort(status, "Unlock intern stripe");
+}
+
+static void intern_grow(intern_stripe_t *stripe)
+{
+  intern_t **old = stripe->chains, *entry, *next, **chain;
+  int bits = stripe->bits, i;
+
+  stripe->bits = bits == 0 ? INTERN_MIN_BITS : bits + 1;
+  stripe->chains = calloc((size_t)1 << stripe->bits, sizeof(intern_t *));
+  if (stripe->chains == NULL)
+    errno_abort("Allocate intern table");
+  for (i = 0; bits > 0 && i < 1 << bits; i++)
+    for (entry = old[i]; entry != NULL; entry = next)
+    {
+      next = entry->next;
+      chain = intern_chain(stripe, entry->hash);
+      entry->next = *chain;
+      *chain = entry;
+    }
+  free(old);
+}
+
+/*
+ * Take memory for a string of size class "class" from the stripe's
+ * free list for that class, or else from its arena.
+ */
+static intern_t *intern_carve(intern_stripe_t *stripe, int class)
+{
+  intern_t *entry = stripe->free[class];
+  size_t size = (size_t)(class + 1) * INTERN_GRAIN;
+
+  if (entry != NULL)
+  {
+    stripe->free[class] = entry->next;
+    return entry;
+  }
+  if (stripe->left < size)
+  {
+    stripe->arena = malloc(INTERN_CHUNK);
+    if (stripe->arena == NULL)
+      errno_abort("Allocate intern arena");
+    stripe->left = INTERN_CHUNK;
+    atomic_fetch_add(&intern_bytes, INTERN_CHUNK);
+  }
+  entry = (intern_t *)stripe->arena;
+  stripe->arena += size;
+  stripe->left -= size;
+  return entry;
+}
+
+static int intern_class(size_t length)
+{
+  return (offsetof(intern_t, text) + length) / INTERN_GRAIN;
+}
+
+/*
+ * Return the interned copy of a string, adding it to the table if
+ * it is not there yet, with one more reference.
+ */
+const char *intern_get(const char *text, size_t length)
+{
+  uint32_t hash = intern_hash(text, length);
+  intern_stripe_t *stripe = &intern_stripes[hash % INTERN_STRIPES];
+  intern_t *entry = NULL, **chain;
+
+  intern_lock(stripe);
+  if (stripe->bits > 0)
+    for (entry = *intern_chain(stripe, hash); entry != NULL; entry = entry->next)
+      if (entry->hash == hash && entry->length == (int)length &&
+          memcmp(entry->text, text, length) == 0)
+        break;
+  if (entry == NULL)
+  {
+    if (stripe->bits == 0 || stripe->count >= 1 << stripe->bits)
+      intern_grow(stripe);
+    entry = intern_carve(stripe, intern_class(length));
+    entry->hash = hash;
+    entry->refs = 0;
+    entry->length = length;
+    memcpy(entry->text, text, length);
+    entry->text[length] = '\0';
+    chain = intern_chain(stripe, hash);
+    entry->next = *chain;
+    *chain = entry;
+    stripe->count++;
+    atomic_fetch_add(&interned, 1);
+  }
+  entry->refs++;
+  intern_unlock(stripe);
+  return entry->text;
+}
+
+static intern_t *intern_entry(const char *text)
+{
+  return (intern_t *)(text - offsetof(intern_t, text));
+}
+
+/*
+ * Take another reference to an interned string. Its hash cannot
+ * change while the caller holds a reference, so it is safe to read
+ * before locking the stripe.
+ */
+void intern_hold(const char *text)
+{
+  intern_t *entry = intern_entry(text);
+  intern_stripe_t *stripe = &intern_stripes[entry->hash % INTERN_STRIPES];
+
+  intern_lock(stripe);
+  entry->refs++;
+  intern_unlock(stripe);
+}
+
+/*
+ * Drop a reference to an interned string, and free it once no
+ * alarm points at it.
+ */
+void intern_drop(const char *text)
+{
+  intern_t *entry = intern_entry(text), **last;
+  intern_stripe_t *stripe = &intern_stripes[entry->hash % INTERN_STRIPES];
+  int class;
+
+  intern_lock(stripe);
+  if (--entry->refs == 0)
+  {
+    last = intern_chain(stripe, entry->hash);
+    while (*last != entry)
+      last = &(*last)->next;
+    *last = entry->next;
+    class = intern_class(entry->length);
+    entry->next = stripe->free[class];
+    stripe->free[class] = entry;
+    stripe->count--;
+    atomic_fetch_sub(&interned, 1);
+  }
+  intern_unlock(stripe);
+}
+
+/*
+ * Give an alarm a message, truncated to fit.
+ */
+void message_set(alarm_t *alarm, const char *text, size_t length)
+{
+  if (length > ALARM_MESSAGE - 1)
+    length = ALARM_MESSAGE - 1;
+  alarm->length = length;
+  if (length < ALARM_INLINE)
+  {
+    memcpy(alarm->text, text, length);
+    alarm->text[length] = '\0';
+    alarm->message = alarm->text;
+  }
+  else
+    alarm->message = intern_get(text, length);
+}
+
+/*
+ * Give alarm "to" the message of alarm "from".
+ */
+void message_copy(alarm_t *to, const alarm_t *from)
+{
+  if (from->message == from->text)
+    message_set(to, from->text, from->length);
+  else
+  {
+    intern_hold(from->message);
+    to->message = from->message;
+    to->length = from->length;
+  }
+}
+
+static void message_clear(alarm_t *alarm)
+{
+  if (alarm->message != alarm->text)
+    intern_drop(alarm->message);
+  alarm->message = NULL;
+}
+
+/*
+ * Placement.
+ *
+ * With "-p cpus", a list such as "0-7,16-23", the program keeps to
+ * those CPUs: the alarm thread of shard i runs on the i'th CPU of
+ * the list, going round again if there are more shards than CPUs,
+ * and every other thread may run on any CPU of the list. Each
+ * shard's memory is kept on the NUMA node of its alarm thread's
+ * CPU. The main thread runs on that CPU while it creates the
+ * shard, so that the kernel's first-touch policy places the shard
+ * and its scheduler there, and whatever the shard allocates later
+ * is allocated by its alarm thread. Alarms come from a pool per
+ * node, whose slabs are bound to the node before they are first
+ * touched; an alarm is taken from the pool of the shard that will
+ * file it, by whichever thread allocates it, and goes back to the
+ * same pool when it is freed. Without "-p", everything is on node
+ * 0 as far as the program is concerned and the kernel places
+ * threads and memory as it likes.
+ */
+#define NODE_MAX 64
+
+int place_count = 0;
+#ifdef __linux__
+int place_cpus[CPU_SETSIZE];
+pthread_attr_t place_any;
+pthread_attr_t place_one;
+
+/*
+ * Parse a list of CPUs, as in "-p" or a node's "cpulist" file,
+ * into "cpus", in order. Returns how many there are, or -1.
+ */
+static int cpus_parse(const char *list, int *cpus, int max)
+{
+  long first, last;
+  char *end;
+  int count = 0;
+
+  while (isdigit((unsigned char)*list))
+  {
+    first = last = strtol(list, &end, 10);
+    if (*end == '-')
+    {
+      list = end + 1;
+      last = strtol(list, &end, 10);
+      if (end == list || last < first)
+        return -1;
+    }
+    for (; first <= last; first++)
+    {
+      if (count == max || first >= CPU_SETSIZE)
+        return -1;
+      cpus[count++] = first;
+    }
+    list = *end == ',' ? end + 1 : end;
+  }
+  if (*list != '\0' && *list != '\n')
+    return -1;
+  return count;
+}
+
+/*
+ * Return the NUMA node of a CPU, from sysfs; 0 if none claims it.
+ */
+int cpu_node(int cpu)
+{
+  static int cpus[CPU_SETSIZE];
+  char path[64], list[4096];
+  ssize_t length;
+  int node, count, fd, i;
+
+  for (node = 0; node < NODE_MAX; node++)
+  {
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+      continue;
+    length = read(fd, list, sizeof(list) - 1);
+    close(fd);
+    if (length <= 0)
+      continue;
+    list[length] = '\0';
+    count = cpus_parse(list, cpus, CPU_SETSIZE);
+    for (i = 0; i < count; i++)
+      if (cpus[i] == cpu)
+        return node;
+  }
+  return 0;
+}
+
+/*
+ * The CPUs a thread is kept to: "cpu" alone, or the whole list if
+ * it is -1.
+ */
+static void place_set(cpu_set_t *set, int cpu)
+{
+  int i;
+
+  CPU_ZERO(set);
+  if (cpu >= 0)
+    CPU_SET(cpu, set);
+  else
+    for (i = 0; i < place_count; i++)
+      CPU_SET(place_cpus[i], set);
+}
+
+/*
+ * Keep the calling thread to "cpu", or to the whole list if it is
+ * -1.
+ */
+void place_self(int cpu)
+{
+  cpu_set_t set;
+  int status;
+
+  if (place_count == 0)
+    return;
+  place_set(&set, cpu);
+  status = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (status != 0)
+    err_abort(status, "Set CPU affinity");
+}
+
+/*
+ * Return the attributes that start a thread on "cpu", or on the
+ * whole list if it is -1; NULL, the defaults, without "-p". Only
+ * the main thread asks for a single CPU.
+ */
+pthread_attr_t *place_attr(int cpu)
+{
+  cpu_set_t set;
+  int status;
+
+  if (place_count == 0)
+    return NULL;
+  if (cpu < 0)
+    return &place_any;
+  place_set(&set, cpu);
+  status = pthread_attr_setaffinity_np(&place_one, sizeof(set), &set);
+  if (status != 0)
+    err_abort(status, "Set CPU affinity");
+  return &place_one;
+}
+
+/*
+ * Take the list given with "-p". Returns false if it is not one.
+ */
+bool place_init(const char *list)
+{
+  cpu_set_t set, allowed;
+  int status, i;
+
+  place_count = cpus_parse(list, place_cpus, CPU_SETSIZE);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    errno_abort("Get CPU affinity");
+  for (i = 0; i < place_count && CPU_ISSET(place_cpus[i], &allowed); i++)
+    ;
+  if (place_count <= 0 || i < place_count)
+  {
+    place_count = 0;
+    return false;
+  }
+  status = pthread_attr_init(&place_any);
+  if (status != 0)
+    err_abort(status, "Init thread attr");
+  status = pthread_attr_init(&place_one);
+  if (status != 0)
+    err_abort(status, "Init thread attr");
+  place_set(&set, -1);
+  status = pthread_attr_setaffinity_np(&place_any, sizeof(set), &set);
+  if (status != 0)
+    err_abort(status, "Set CPU affinity");
+  place_self(-1);
+  return true;
+}
+
+/*
+ * Return the CPU of a shard's alarm thread, or -1 without "-p".
+ */
+int place_cpu(int id)
+{
+  if (place_count == 0)
+    return -1;
+  return place_cpus[id % place_count];
+}
+
+/*
+ * Ask for a page-aligned range of memory that has not been touched
+ * yet to be placed on "node". This is only a preference; if the
+ * kernel refuses, the memory is placed on first touch.
+ */
+static void node_bind(void *memory, size_t size, int node)
+{
+  unsigned long mask = 1UL << node;
+
+  if (place_count > 0)
+    (void)syscall(SYS_mbind, memory, size, MPOL_PREFERRED, &mask, NODE_MAX + 1, 0);
+}
+#else
+bool place_init(const char *list)
+{
+  return false;
+}
+
+void place_self(int cpu)
+{
+}
+
+pthread_attr_t *place_attr(int cpu)
+{
+  return NULL;
+}
+
+int place_cpu(int id)
+{
+  return -1;
+}
+
+int cpu_node(int cpu)
+{
+  return 0;
+}
+
+static void node_bind(void *memory, size_t size, int node)
+{
+}
+#endif
+
+/*
+ * Alarm pool.
+ *
+ * Alarms are carved out of cache-line aligned slabs instead of
+ * being allocated one at a time with malloc. Each thread keeps a
+ * private cache of free alarms, so allocating and freeing normally
+ * touch no lock at all. The main thread allocates and the alarm
+ * thread frees, so free alarms drift from one cache to the other:
+ * a cache that grows past two batches hands a batch of POOL_BATCH
+ * alarms to the shared pool, and an empty cache takes a batch
+ * back, or a fresh slab when the shared pool is empty too. Batches
+ * are chained through "link", and the shared pool chains batches
+ * through the "prev" field of their first alarm. Slabs are never
+ * returned to the system. There is a shared pool, and a cache in
+ * each thread, for each NUMA node (see "Placement").
+ *
+ * A free alarm has no message; alarm_free() releases the message
+ * of an alarm that still has one.
+ */
+#define POOL_LINE 64
+#define POOL_PAGE 4096
+#define POOL_SLAB 256
+#define POOL_BATCH 64
+#define POOL_STRIDE ((sizeof(alarm_t) + POOL_LINE - 1) & ~(size_t)(POOL_LINE - 1))
+
+typedef struct pool_tag
+{
+  short_lock_t lock;
+  alarm_t *batches;
+} pool_t;
+
+pool_t pools[NODE_MAX];
+int pool_slabs = 0;
+__thread alarm_t *pool_cache[NODE_MAX];
+__thread int pool_cached[NODE_MAX];
+
+void pool_init(void)
+{
+  int status, i;
+
+  for (i = 0; i < NODE_MAX; i++)
+  {
+    status = short_init(&pools[i].lock);
+    if (status != 0)
+      err_abort(status, "Init pool lock");
+  }
+}
+
+/*
+ * Refill this thread's empty cache for a node from the node's
+ * shared pool.
+ */
+static void pool_refill(int node)
+{
+  alarm_t *alarm;
+  char *slab;
+  int64_t locked;
+  int status, i;
+
+  locked = short_lock(&pools[node].lock, &pool_lock_stats);
+  alarm = pools[node].batches;
+  if (alarm != NULL)
+    pools[node].batches = alarm->prev;
+  else
+    pool_slabs++;
+  short_unlock(&pools[node].lock, locked);
+  if (alarm != NULL)
+  {
+    pool_cache[node] = alarm;
+    pool_cached[node] = POOL_BATCH;
+    return;
+  }
+  status = posix_memalign((void **)&slab, POOL_PAGE, POOL_SLAB * POOL_STRIDE);
+  if (status != 0)
+    err_abort(status, "Allocate alarm slab");
+  node_bind(slab, POOL_SLAB * POOL_STRIDE, node);
+  atomic_fetch_add(&pool_bytes, POOL_SLAB * POOL_STRIDE);
+  for (i = POOL_SLAB - 1; i >= 0; i--)
+  {
+    alarm = (alarm_t *)(slab + i * POOL_STRIDE);
+    alarm->node = node;
+    alarm->message = NULL;
+    alarm->link = pool_cache[node];
+    pool_cache[node] = alarm;
+  }
+  pool_cached[node] = POOL_SLAB;
+}
+
+/*
+ * Allocate an alarm from the pool of a NUMA node: that of the
+ * shard that is going to own it.
+ */
+alarm_t *alarm_alloc(int node)
+{
+  alarm_t *alarm;
+
+  if (pool_cache[node] == NULL)
+    pool_refill(node);
+  alarm = pool_cache[node];
+  pool_cache[node] = alarm->link;
+  pool_cached[node]--;
+  return alarm;
+}
+
+void alarm_free(alarm_t *alarm)
+{
+  alarm_t *batch, *tail;
+  int64_t locked;
+  int node = alarm->node, i;
+
+  if (alarm->message != NULL)
+    message_clear(alarm);
+  alarm->link = pool_cache[node];
+  pool_cache[node] = alarm;
+  if (++pool_cached[node] < 2 * POOL_BATCH)
+    return;
+  /*
+   * Give the batch at the head of the cache to the shared pool.
+   */
+  batch = pool_cache[node];
+  for (tail = batch, i = 1; i < POOL_BATCH; i++)
+    tail = tail->link;
+  pool_cache[node] = tail->link;
+  pool_cached[node] -= POOL_BATCH;
+  tail->link = NULL;
+  locked = short_lock(&pools[node].lock, &pool_lock_stats);
+  batch->prev = pools[node].batches;
+  pools[node].batches = batch;
+  short_unlock(&pools[node].lock, locked);
+}
+
+/*
+ * Return true if alarm "a" must expire before alarm "b".
+ */
+static int alarm_before(alarm_t *a, alarm_t *b)
+{
+  if (a->time != b->time)
+    return a->time < b->time;
+  return a->seq < b->seq;
+}
+
+void vec_push(alarm_vec_t *vec, alarm_t *alarm)
+{
+  alarm_t **items;
+
+  if (vec->count == vec->size)
+  {
+    vec->size = vec->size == 0 ? 64 : vec->size * 2;
+    items = realloc(vec->items, vec->size * sizeof(alarm_t *));
+    if (items == NULL)
+      errno_abort("Grow alarm array");
+    vec->items = items;
+  }
+  vec->items[vec->count++] = alarm;
+}
+
+/*
+ * Heap backend.
+ *
+ * Pending alarms are kept in a binary min-heap, ordered by
+ * expiration time, rather than in a sorted list. The earliest
+ * alarm is always the first entry, an insert or a removal costs
+ * O(log n) instead of a walk over every pending alarm, and each
+ * alarm's "index" lets it be removed from the middle of the heap
+ * without searching for it.
+ *
+ * The heap holds a copy of each alarm's sort key next to the
+ * pointer to it, so that sifting compares entries of one dense
+ * array and only writes back the "index" of the alarms it moves.
+ */
+typedef struct heap_entry_tag
+{
+  int64_t time;
+  unsigned long seq;
+  alarm_t *alarm;
+} heap_entry_t;
+
+typedef struct heap_tag
+{
+  heap_entry_t *entries;
+  int count;
+  int capacity;
+} heap_t;
+
+void *heap_create(void)
+{
+  heap_t *heap = calloc(1, sizeof(heap_t));
+
+  if (heap == NULL)
+    errno_abort("Allocate alarm heap");
+  return heap;
+}
+
+static int entry_before(const heap_entry_t *a, const heap_entry_t *b)
+{
+  if (a->time != b->time)
+    return a->time < b->time;
+  return a->seq < b->seq;
+}
+
+static void heap_place(heap_t *heap, int index, const heap_entry_t *entry)
+{
+  heap->entries[index] = *entry;
+  entry->alarm->index = index;
+}
+
+static void heap_sift_up(heap_t *heap, int index)
+{
+  heap_entry_t entry = heap->entries[index];
+  int parent;
+
+  while (index > 0)
+  {
+    parent = (index - 1) / 2;
+    if (!entry_before(&entry, &heap->entries[parent]))
+      break;
+    heap_place(heap, index, &heap->entries[parent]);
+    index = parent;
+  }
+  heap_place(heap, index, &entry);
+}
+
+static void heap_sift_down(heap_t *heap, int index)
+{
+  heap_entry_t entry = heap->entries[index];
+  int child;
+
+  while ((child = 2 * index + 1) < heap->count)
+  {
+    if (child + 1 < heap->count &&
+        entry_before(&heap->entries[child + 1], &heap->entries[child]))
+      child++;
+    if (!entry_before(&heap->entries[child], &entry))
+      break;
+    heap_place(heap, index, &heap->entries[child]);
+    index = child;
+  }
+  heap_place(heap, index, &entry);
+}
+
+/*
+ * Add an alarm to the heap, growing the heap array if needed.
+ */
+void heap_push(void *queue, alarm_t *alarm)
+{
+  heap_t *heap = queue;
+  heap_entry_t *entries, entry;
+  int capacity;
+
+  if (heap->count == heap->capacity)
+  {
+    capacity = heap->capacity == 0 ? 64 : heap->capacity * 2;
+    entries = realloc(heap->entries, capacity * sizeof(heap_entry_t));
+    if (entries == NULL)
+      errno_abort("Grow alarm heap");
+    heap->entries = entries;
+    heap->capacity = capacity;
+  }
+  entry.time = alarm->time;
+  entry.seq = alarm->seq;
+  entry.alarm = alarm;
+  heap_place(heap, heap->count++, &entry);
+  heap_sift_up(heap, alarm->index);
+}
+
+/*
+ * Remove an alarm from anywhere in the heap. The last entry is
+ * moved into the hole and then sifted whichever way restores the
+ * heap order.
+ */
+void heap_remove(void *queue, alarm_t *alarm)
+{
+  heap_t *heap = queue;
+  int index = alarm->index;
+
+  if (--heap->count != index)
+  {
+    heap_place(heap, index, &heap->entries[heap->count]);
+    if (index > 0 && entry_before(&heap->entries[index], &heap->entries[(index - 1) / 2]))
+      heap_sift_up(heap, index);
+    else
+      heap_sift_down(heap, index);
+  }
+  alarm->index = -1;
+}
+
+int64_t heap_next_time(void *queue)
+{
+  heap_t *heap = queue;
+
+  return heap->count == 0 ? 0 : heap->entries[0].time;
+}
+
+alarm_t *heap_due(void *queue, int64_t now)
+{
+  heap_t *heap = queue;
+
+  if (heap->count == 0 || heap->entries[0].time > now)
+    return NULL;
+  return heap->entries[0].alarm;
+}
+
+/*
+ * Give an alarm a new time, and a new "seq", assigned by the
+ * caller, by sifting its entry from where it is.
+ */
+void heap_retime(void *queue, alarm_t *alarm, int64_t time)
+{
+  heap_t *heap = queue;
+  heap_entry_t *entry = &heap->entries[alarm->index];
+  bool later = time > entry->time || (time == entry->time && alarm->seq > entry->seq);
+
+  alarm->time = entry->time = time;
+  entry->seq = alarm->seq;
+  if (later)
+    heap_sift_down(heap, alarm->index);
+  else
+    heap_sift_up(heap, alarm->index);
+}
+
+alarm_t *heap_first(void *queue)
+{
+  heap_t *heap = queue;
+
+  return heap->count == 0 ? NULL : heap->entries[0].alarm;
+}
+
+alarm_t *heap_next(void *queue, alarm_t *alarm)
+{
+  heap_t *heap = queue;
+
+  return alarm->index + 1 < heap->count ? heap->entries[alarm->index + 1].alarm : NULL;
+}
+
+/*
+ * Collect the alarms in a window from the subtree at "index": no
+ * entry below one that is later than "to" can be in it.
+ */
+static void heap_range_at(heap_t *heap, int index, int64_t from, int64_t to,
+                          alarm_vec_t *found)
+{
+  while (index < heap->count && heap->entries[index].time <= to)
+  {
+    if (heap->entries[index].time >= from)
+      vec_push(found, heap->entries[index].alarm);
+    heap_range_at(heap, 2 * index + 1, from, to, found);
+    index = 2 * index + 2;
+  }
+}
+
+void heap_range(void *queue, int64_t from, int64_t to, alarm_vec_t *found)
+{
+  heap_range_at(queue, 0, from, to, found);
+}
+
+const sched_ops_t heap_ops = {
+    "heap", heap_create, heap_push, heap_remove, heap_next_time,
+    heap_due, heap_retime, heap_first, heap_next, heap_range};
+
+/*
+ * Wheel backend.
+ *
+ * A hierarchical timing wheel that turns once every WHEEL_TICK
+ * nanoseconds. Level 0 has one slot for each of the next
+ * WHEEL_SIZE ticks; each slot of level n covers WHEEL_SIZE slots
+ * of level n-1. An alarm is filed at the lowest level whose span
+ * covers its delay, so inserting costs O(1), and when the wheel
+ * reaches the start of a higher-level slot, that slot's alarms are
+ * "cascaded" down to the level below. Alarms beyond the span of
+ * the top level wait in its farthest slot and are filed again each
+ * time they cascade.
+ *
+ * "now" is the tick being expired: every alarm in an earlier
+ * tick has already been returned by due, and an alarm inserted
+ * with an earlier time is filed in the current slot. A bitmap per
+ * level records which slots are occupied, so that the wheel can
+ * jump straight over empty ticks. Within a level 0 slot, alarms
+ * are kept in alarm_before() order, so the head of a slot gives
+ * the exact time at which the slot is due; each slot is a
+ * circular, doubly linked list through "link" and "prev".
+ *
+ * Higher slots are unordered, but "min" keeps a lower bound
+ * on the times in each of them: the earliest time ever filed there
+ * since the slot was last empty. next_time reports that bound
+ * rather than the tick at which the slot cascades, so the alarm
+ * thread is not woken just to move alarms that are not yet due;
+ * due catches up on any cascades it has passed.
+ */
+#define WHEEL_TICK (NSEC_PER_SEC / 1000)
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 5
+#define WHEEL_SPAN ((int64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+
+typedef struct wheel_tag
+{
+  alarm_t *slot[WHEEL_LEVELS][WHEEL_SIZE];
+  int64_t min[WHEEL_LEVELS][WHEEL_SIZE];
+  uint64_t map[WHEEL_LEVELS];
+  int64_t now;
+  int count;
+} wheel_t;
+
+void *wheel_create(void)
+{
+  wheel_t *wheel = calloc(1, sizeof(wheel_t));
+
+  if (wheel == NULL)
+    errno_abort("Allocate timing wheel");
+  return wheel;
+}
+
+/*
+ * Rotate a slot bitmap right, so that bit "n" of the result is
+ * the occupancy of the n'th slot after slot "start".
+ */
+static uint64_t wheel_rotate(uint64_t map, int start)
+{
+  start &= WHEEL_MASK;
+  if (start == 0)
+    return map;
+  return (map >> start) | (map << (WHEEL_SIZE - start));
+}
+
+static void wheel_link(wheel_t *wheel, int level, int slot, alarm_t *alarm)
+{
+  alarm_t **head = &wheel->slot[level][slot];
+  alarm_t *tail, *after;
+
+  alarm->index = level * WHEEL_SIZE + slot;
+  if (*head == NULL)
+  {
+    alarm->link = alarm->prev = alarm;
+    *head = alarm;
+    wheel->map[level] |= (uint64_t)1 << slot;
+    wheel->min[level][slot] = alarm->time;
+    return;
+  }
+  if (alarm->time < wheel->min[level][slot])
+    wheel->min[level][slot] = alarm->time;
+  /*
+   * Higher levels are unordered. At level 0, walk back from the
+   * tail to the last alarm that must expire first; that is almost
+   * always the tail itself. NULL means the new alarm becomes the
+   * head, which is the same place in the circle as after the tail.
+   */
+  tail = after = (*head)->prev;
+  if (level == 0)
+    while (after != NULL && alarm_before(alarm, after))
+      after = after == *head ? NULL : after->prev;
+  if (after == NULL)
+  {
+    after = tail;
+    *head = alarm;
+  }
+  alarm->prev = after;
+  alarm->link = after->link;
+  after->link->prev = alarm;
+  after->link = alarm;
+}
+
+static void wheel_unlink(wheel_t *wheel, alarm_t *alarm)
+{
+  int level = alarm->index / WHEEL_SIZE;
+  int slot = alarm->index % WHEEL_SIZE;
+  alarm_t **head = &wheel->slot[level][slot];
+
+  if (alarm->link == alarm)
+  {
+    *head = NULL;
+    wheel->map[level] &= ~((uint64_t)1 << slot);
+  }
+  else
+  {
+    alarm->prev->link = alarm->link;
+    alarm->link->prev = alarm->prev;
+    if (*head == alarm)
+      *head = alarm->link;
+  }
+  alarm->index = -1;
+}
+
+/*
+ * File an alarm at the level and slot for its tick, relative to
+ * wheel->now.
+ */
+static void wheel_file(wheel_t *wheel, alarm_t *alarm)
+{
+  int64_t tick = alarm->time / WHEEL_TICK, delta;
+  int level;
+
+  if (tick < wheel->now)
+    tick = wheel->now;
+  delta = tick - wheel->now;
+  if (delta >= WHEEL_SPAN)
+  {
+    delta = WHEEL_SPAN - 1;
+    tick = wheel->now + delta;
+  }
+  for (level = 0; level < WHEEL_LEVELS - 1; level++)
+    if (delta < (int64_t)1 << (WHEEL_BITS * (level + 1)))
+      break;
+  wheel_link(wheel, level, (tick >> (WHEEL_BITS * level)) & WHEEL_MASK, alarm);
+}
+
+void wheel_insert(void *queue, alarm_t *alarm)
+{
+  wheel_t *wheel = queue;
+  int64_t now;
+
+  /*
+   * An empty wheel may have stopped turning a long time ago;
+   * bring it up to date so the alarm is filed at the right level.
+   */
+  if (wheel->count == 0)
+  {
+    now = clock_now() / WHEEL_TICK;
+    if (now > wheel->now)
+      wheel->now = now;
+  }
+  wheel_file(wheel, alarm);
+  wheel->count++;
+}
+
+void wheel_remove(void *queue, alarm_t *alarm)
+{
+  wheel_t *wheel = queue;
+
+  wheel_unlink(wheel, alarm);
+  wheel->count--;
+}
+
+/*
+ * Return the first tick, from wheel->now on, whose level 0 slot is
+ * occupied, or 0 if level 0 is empty.
+ */
+static int64_t wheel_next_slot(wheel_t *wheel)
+{
+  if (wheel->map[0] == 0)
+    return 0;
+  return wheel->now +
+         __builtin_ctzll(wheel_rotate(wheel->map[0], wheel->now & WHEEL_MASK));
+}
+
+/*
+ * Return the first tick after wheel->now at which a higher slot
+ * must be cascaded, or 0 if the higher levels are empty.
+ */
+static int64_t wheel_next_cascade(wheel_t *wheel)
+{
+  int64_t next = 0, when, block;
+  int level, shift;
+
+  for (level = 1; level < WHEEL_LEVELS; level++)
+  {
+    if (wheel->map[level] == 0)
+      continue;
+    /*
+     * The current slot of this level was cascaded when the wheel
+     * entered it, so anything in it belongs to the next lap.
+     */
+    shift = WHEEL_BITS * level;
+    block = wheel->now >> shift;
+    when = (block + 1 + __builtin_ctzll(wheel_rotate(wheel->map[level], block + 1))) << shift;
+    if (next == 0 || when < next)
+      next = when;
+  }
+  return next;
+}
+
+/*
+ * The wheel has just reached wheel->now: move the alarms of every
+ * higher slot that starts here down to the levels below.
+ */
+static void wheel_cascade(wheel_t *wheel)
+{
+  alarm_t *alarm, *next;
+  int level, slot;
+
+  for (level = 1; level < WHEEL_LEVELS; level++)
+  {
+    if (wheel->now & (((int64_t)1 << (WHEEL_BITS * level)) - 1))
+      break;
+    slot = (wheel->now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    alarm = wheel->slot[level][slot];
+    if (alarm == NULL)
+      continue;
+    wheel->slot[level][slot] = NULL;
+    wheel->map[level] &= ~((uint64_t)1 << slot);
+    alarm->prev->link = NULL;
+    for (; alarm != NULL; alarm = next)
+    {
+      next = alarm->link;
+      wheel_file(wheel, alarm);
+    }
+  }
+}
+
+int64_t wheel_next_time(void *queue)
+{
+  wheel_t *wheel = queue;
+  int64_t slot, when, next = 0;
+  int level, first;
+  uint64_t map;
+
+  if (wheel->count == 0)
+    return 0;
+  slot = wheel_next_slot(wheel);
+  if (slot != 0)
+    next = wheel->slot[0][slot & WHEEL_MASK]->time;
+  /*
+   * Below the top level, the first occupied slot in lap order
+   * holds that level's earliest alarms. The top level also holds
+   * the alarms beyond its span, filed in whichever slot was
+   * farthest at the time, so every one of its slots is examined.
+   */
+  for (level = 1; level < WHEEL_LEVELS; level++)
+  {
+    if (wheel->map[level] == 0)
+      continue;
+    first = (wheel->now >> (WHEEL_BITS * level)) + 1;
+    first += __builtin_ctzll(wheel_rotate(wheel->map[level], first));
+    when = wheel->min[level][first & WHEEL_MASK];
+    if (level == WHEEL_LEVELS - 1)
+      for (map = wheel->map[level]; map != 0; map &= map - 1)
+        if (wheel->min[level][__builtin_ctzll(map)] < when)
+          when = wheel->min[level][__builtin_ctzll(map)];
+    if (next == 0 || when < next)
+      next = when;
+  }
+  return next;
+}
+
+alarm_t *wheel_due(void *queue, int64_t now)
+{
+  wheel_t *wheel = queue;
+  alarm_t *alarm;
+  int64_t tick = now / WHEEL_TICK, slot, cascade, next;
+
+  while (wheel->now <= tick)
+  {
+    alarm = wheel->slot[0][wheel->now & WHEEL_MASK];
+    if (alarm != NULL)
+    {
+      /*
+       * Only the current tick can hold an alarm that is not due
+       * yet; any earlier tick has passed completely.
+       */
+      if (alarm->time > now)
+        return NULL;
+      return alarm;
+    }
+    slot = wheel_next_slot(wheel);
+    cascade = wheel_next_cascade(wheel);
+    next = slot == 0 || (cascade != 0 && cascade < slot) ? cascade : slot;
+    if (next == 0 || next > tick)
+    {
+      wheel->now = tick;
+      break;
+    }
+    wheel->now = next;
+    if (next == cascade)
+      wheel_cascade(wheel);
+  }
+  return NULL;
+}
+
+/*
+ * Move an alarm to the slot for its new time.
+ */
+void wheel_retime(void *queue, alarm_t *alarm, int64_t time)
+{
+  wheel_t *wheel = queue;
+
+  wheel_unlink(wheel, alarm);
+  alarm->time = time;
+  wheel_file(wheel, alarm);
+}
+
+static alarm_t *wheel_scan(wheel_t *wheel, int position)
+{
+  for (; position < WHEEL_LEVELS * WHEEL_SIZE; position++)
+    if (wheel->slot[position / WHEEL_SIZE][position % WHEEL_SIZE] != NULL)
+      return wheel->slot[position / WHEEL_SIZE][position % WHEEL_SIZE];
+  return NULL;
+}
+
+alarm_t *wheel_first(void *queue)
+{
+  wheel_t *wheel = queue;
+
+  return wheel_scan(wheel, 0);
+}
+
+alarm_t *wheel_next(void *queue, alarm_t *alarm)
+{
+  wheel_t *wheel = queue;
+
+  if (alarm->link != wheel->slot[alarm->index / WHEEL_SIZE][alarm->index % WHEEL_SIZE])
+    return alarm->link;
+  return wheel_scan(wheel, alarm->index + 1);
+}
+
+/*
+ * Collect the alarms in a window. A level 0 slot is sorted, so its
+ * walk stops at the first alarm after "to"; a higher slot is
+ * skipped when its lower bound is after "to".
+ */
+void wheel_range(void *queue, int64_t from, int64_t to, alarm_vec_t *found)
+{
+  wheel_t *wheel = queue;
+  alarm_t *head, *alarm;
+  int level, slot;
+
+  for (level = 0; level < WHEEL_LEVELS; level++)
+    for (slot = 0; slot < WHEEL_SIZE; slot++)
+    {
+      head = wheel->slot[level][slot];
+      if (head == NULL || (level > 0 && wheel->min[level][slot] > to))
+        continue;
+      alarm = head;
+      do
+      {
+        if (alarm->time <= to && alarm->time >= from)
+          vec_push(found, alarm);
+        else if (level == 0 && alarm->time > to)
+          break;
+        alarm = alarm->link;
+      } while (alarm != head);
+    }
+}
+
+const sched_ops_t wheel_ops = {
+    "wheel", wheel_create, wheel_insert, wheel_remove, wheel_next_time,
+    wheel_due, wheel_retime, wheel_first, wheel_next, wheel_range};
+
+/*
+ * The backend in use, chosen with the "-b" option, or fixed with
+ * "-DALARM_SCHED", in which case "sched" is a constant and the
+ * compiler calls the backend's functions directly.
+ */
+#define SCHED_OPS_OF(name) name##_ops
+#define SCHED_OPS(name) SCHED_OPS_OF(name)
+#ifdef ALARM_SCHED
+const sched_ops_t *const sched = &SCHED_OPS(ALARM_SCHED);
+const sched_ops_t *const sched_backends[] = {&SCHED_OPS(ALARM_SCHED), NULL};
+#define sched_choose(ops) ((void)(ops))
+#else
+const sched_ops_t *sched = &heap_ops;
+const sched_ops_t *const sched_backends[] = {&heap_ops, &wheel_ops, NULL};
+#define sched_choose(ops) ((void)(sched = (ops)))
+#endif
+
+/*
+ * Indexes.
+ *
+ * Each shard indexes its pending Type A alarms by message number,
+ * and its lists of alarms by message type, in chained hash tables
+ * that double in size whenever they hold more entries than
+ * buckets; only the shard's alarm thread uses them. Message type
+ * records are shared, in the type registry, a table of the same
+ * kind protected by type_lock. Replacing, cancelling, pausing and
+ * resuming look up their target here instead of walking the
+ * scheduler.
+ *
+ * The registry is read far more often than it changes: every Type
+ * A request looks up its type, and most Create, Pause and Resume
+ * requests only find that they are in error. So type_lock is a
+ * reader/writer lock, held exclusively only to add a type or to
+ * change one's display thread, and a thread that submits requests
+ * first tries the record it found last, in "type_last", which
+ * needs no lock at all, since records are never freed and their
+ * message type never changes.
+ */
+#define INDEX_MIN_BITS 6
+
+pthread_rwlock_t type_lock = PTHREAD_RWLOCK_INITIALIZER;
+__thread msgtype_t *type_last;
+msgtype_t **type_index = NULL;
+int type_bits = 0;
+int type_count = 0;
+
+static unsigned index_hash(int key, int bits)
+{
+  return ((unsigned)key * 2654435769u) >> (32 - bits);
+}
+
+/*
+ * Allocate a bucket array of 2^bits empty chains.
+ */
+static void *index_buckets(int bits)
+{
+  void *buckets;
+
+  buckets = calloc((size_t)1 << bits, sizeof(void *));
+  if (buckets == NULL)
+    errno_abort("Allocate index");
+  return buckets;
+}
+
+/*
+ * Double the message number index, or, with "reserve", make it
+ * big enough for that many alarms in one go.
+ */
+static void number_grow(shard_t *shard, int reserve)
+{
+  alarm_t **old = shard->number_index, *alarm, *next;
+  int bits = shard->number_bits, i;
+  unsigned bucket;
+
+  shard->number_bits = bits == 0 ? INDEX_MIN_BITS : bits + 1;
+  while (shard->number_bits < 30 && 1 << shard->number_bits < reserve)
+    shard->number_bits++;
+  shard->number_index = index_buckets(shard->number_bits);
+  for (i = 0; bits > 0 && i < 1 << bits; i++)
+    for (alarm = old[i]; alarm != NULL; alarm = next)
+    {
+      next = alarm->hash_next;
+      bucket = index_hash(alarm->messageNumber, shard->number_bits);
+      alarm->hash_next = shard->number_index[bucket];
+      shard->number_index[bucket] = alarm;
+    }
+  free(old);
+}
+
+alarm_t *number_find(shard_t *shard, int messageNumber)
+{
+  alarm_t *alarm;
+
+  if (shard->number_count == 0)
+    return NULL;
+  alarm = shard->number_index[index_hash(messageNumber, shard->number_bits)];
+  while (alarm != NULL && alarm->messageNumber != messageNumber)
+    alarm = alarm->hash_next;
+  return alarm;
+}
+
+static void number_add(shard_t *shard, alarm_t *alarm)
+{
+  unsigned bucket;
+
+  if (shard->number_index == NULL || shard->number_count >= 1 << shard->number_bits)
+    number_grow(shard, 0);
+  bucket = index_hash(alarm->messageNumber, shard->number_bits);
+  alarm->hash_next = shard->number_index[bucket];
+  shard->number_index[bucket] = alarm;
+  shard->number_count++;
+}
+
+void number_reserve(shard_t *shard, int count)
+{
+  if (count > 1 << shard->number_bits)
+    number_grow(shard, count);
+}
+
+static void number_remove(shard_t *shard, alarm_t *alarm)
+{
+  alarm_t **last;
+
+  last = &shard->number_index[index_hash(alarm->messageNumber, shard->number_bits)];
+  while (*last != alarm)
+    last = &(*last)->hash_next;
+  *last = alarm->hash_next;
+  shard->number_count--;
+}
+
+static void tlist_grow(shard_t *shard)
+{
+  typelist_t **old = shard->type_index, *tlist, *next;
+  int bits = shard->type_bits, i;
+  unsigned bucket;
+
+  shard->type_bits = bits == 0 ? INDEX_MIN_BITS : bits + 1;
+  shard->type_index = index_buckets(shard->type_bits);
+  for (i = 0; bits > 0 && i < 1 << bits; i++)
+    for (tlist = old[i]; tlist != NULL; tlist = next)
+    {
+      next = tlist->hash_next;
+      bucket = index_hash(tlist->messageType, shard->type_bits);
+      tlist->hash_next = shard->type_index[bucket];
+      shard->type_index[bucket] = tlist;
+    }
+  free(old);
+}
+
+typelist_t *tlist_find(shard_t *shard, int messageType)
+{
+  typelist_t *tlist;
+
+  if (shard->type_count == 0)
+    return NULL;
+  tlist = shard->type_index[index_hash(messageType, shard->type_bits)];
+  while (tlist != NULL && tlist->messageType != messageType)
+    tlist = tlist->hash_next;
+  return tlist;
+}
+
+/*
+ * Find a shard's list for a message type, creating it if there is
+ * none.
+ */
+typelist_t *tlist_get(shard_t *shard, int messageType)
+{
+  typelist_t *tlist;
+  unsigned bucket;
+
+  tlist = tlist_find(shard, messageType);
+  if (tlist != NULL)
+    return tlist;
+  if (shard->type_index == NULL || shard->type_count >= 1 << shard->type_bits)
+    tlist_grow(shard);
+  tlist = calloc(1, sizeof(typelist_t));
+  if (tlist == NULL)
+    errno_abort("Allocate message type list");
+  tlist->messageType = messageType;
+  bucket = index_hash(messageType, shard->type_bits);
+  tlist->hash_next = shard->type_index[bucket];
+  shard->type_index[bucket] = tlist;
+  shard->type_count++;
+  return tlist;
+}
+
+/*
+ * Free a shard's list for a message type once it is empty.
+ */
+void tlist_release(shard_t *shard, typelist_t *tlist)
+{
+  typelist_t **last;
+
+  if (tlist->count > 0)
+    return;
+  last = &shard->type_index[index_hash(tlist->messageType, shard->type_bits)];
+  while (*last != tlist)
+    last = &(*last)->hash_next;
+  *last = tlist->hash_next;
+  shard->type_count--;
+  free(tlist);
+}
+
+static void type_grow(void)
+{
+  msgtype_t **old = type_index, *mtype, *next;
+  int bits = type_bits, i;
+  unsigned bucket;
+
+  type_bits = bits == 0 ? INDEX_MIN_BITS : bits + 1;
+  type_index = index_buckets(type_bits);
+  for (i = 0; bits > 0 && i < 1 << bits; i++)
+    for (mtype = old[i]; mtype != NULL; mtype = next)
+    {
+      next = mtype->hash_next;
+      bucket = index_hash(mtype->messageType, type_bits);
+      mtype->hash_next = type_index[bucket];
+      type_index[bucket] = mtype;
+    }
+  free(old);
+}
+
+/*
+ * Find the registry record for a message type. The caller must
+ * hold type_lock, shared or exclusive.
+ */
+msgtype_t *type_find(int messageType)
+{
+  msgtype_t *mtype;
+
+  if (type_count == 0)
+    return NULL;
+  mtype = type_index[index_hash(messageType, type_bits)];
+  while (mtype != NULL && mtype->messageType != messageType)
+    mtype = mtype->hash_next;
+  return mtype;
+}
+
+/*
+ * Find the registry record for a message type, creating it if
+ * there is none. The caller must hold type_lock exclusively.
+ */
+msgtype_t *type_get(int messageType)
+{
+  msgtype_t *mtype;
+  unsigned bucket;
+
+  mtype = type_find(messageType);
+  if (mtype != NULL)
+    return mtype;
+  if (type_index == NULL || type_count >= 1 << type_bits)
+    type_grow();
+  mtype = calloc(1, sizeof(msgtype_t));
+  if (mtype == NULL)
+    errno_abort("Allocate message type");
+  mtype->messageType = messageType;
+  bucket = index_hash(messageType, type_bits);
+  mtype->hash_next = type_index[bucket];
+  type_index[bucket] = mtype;
+  type_count++;
+  return mtype;
+}
+
+/*
+ * Count a Type A alarm that is about to be submitted against its
+ * message type. This may be called from any thread.
+ */
+void type_hold(alarm_t *alarm)
+{
+  msgtype_t *mtype = type_last;
+  int status;
+
+  if (mtype == NULL || mtype->messageType != alarm->messageType)
+  {
+    status = pthread_rwlock_rdlock(&type_lock);
+    if (status != 0)
+      err_abort(status, "Lock registry");
+    mtype = type_find(alarm->messageType);
+    status = pthread_rwlock_unlock(&type_lock);
+    if (status != 0)
+      err_abort(status, "Unlock registry");
+    if (mtype == NULL)
+    {
+      status = pthread_rwlock_wrlock(&type_lock);
+      if (status != 0)
+        err_abort(status, "Lock registry");
+      mtype = type_get(alarm->messageType);
+      status = pthread_rwlock_unlock(&type_lock);
+      if (status != 0)
+        err_abort(status, "Unlock registry");
+    }
+    type_last = mtype;
+  }
+  alarm->mtype = mtype;
+  atomic_fetch_add_explicit(&mtype->count, 1, memory_order_relaxed);
+}
+
+/*
+ * Enter a Type A alarm into both of its shard's indexes.
+ */
+void alarm_index_add(shard_t *shard, alarm_t *alarm)
+{
+  typelist_t *tlist;
+
+  number_add(shard, alarm);
+  tlist = tlist_get(shard, alarm->messageType);
+  alarm->tlist = tlist;
+  alarm->type_prev = NULL;
+  alarm->type_next = tlist->alarms;
+  if (tlist->alarms != NULL)
+    tlist->alarms->type_prev = alarm;
+  tlist->alarms = alarm;
+  tlist->count++;
+}
+
+/*
+ * Take an alarm out of its shard's indexes, and stop counting it
+ * against its message type.
+ */
+void alarm_index_remove(shard_t *shard, alarm_t *alarm)
+{
+  typelist_t *tlist = alarm->tlist;
+
+  number_remove(shard, alarm);
+  if (alarm->type_prev != NULL)
+    alarm->type_prev->type_next = alarm->type_next;
+  else
+    tlist->alarms = alarm->type_next;
+  if (alarm->type_next != NULL)
+    alarm->type_next->type_prev = alarm->type_prev;
+  tlist->count--;
+  alarm->tlist = NULL;
+  tlist_release(shard, tlist);
+  atomic_fetch_sub_explicit(&alarm->mtype->count, 1, memory_order_relaxed);
+}
+
+/*
+ * Keep a shard's count of pending alarms, and the copies of it
+ * that Stats reads, up to date.
+ */
+static void shard_count_add(shard_t *shard, int delta)
+{
+  shard->count += delta;
+  atomic_store_explicit(&shard->pending, shard->count, memory_order_relaxed);
+  if (shard->count > atomic_load_explicit(&shard->peak, memory_order_relaxed))
+    atomic_store_explicit(&shard->peak, shard->count, memory_order_relaxed);
+}
+
+/*
+ * Count a Type A alarm that is leaving its shard for good against
+ * the shard's next admit_flush.
+ */
+static void admit_release(shard_t *shard, const alarm_t *alarm)
+{
+  shard->released++;
+  shard->released_bytes += alarm->length;
+}
+
+/*
+ * Take what a shard has released off the admission totals, and
+ * wake any thread waiting for room.
+ */
+static void admit_flush(shard_t *shard)
+{
+  int status;
+
+  if (shard->released == 0)
+    return;
+  atomic_fetch_sub(&admitted, shard->released);
+  atomic_fetch_sub(&admitted_bytes, shard->released_bytes);
+  shard->released = shard->released_bytes = 0;
+  if (atomic_load(&admit_waiters) > 0)
+  {
+    status = pthread_mutex_lock(&admit_mutex);
+    if (status != 0)
+      err_abort(status, "Lock mutex");
+    status = pthread_cond_broadcast(&admit_cond);
+    if (status != 0)
+      err_abort(status, "Broadcast cond");
+    status = pthread_mutex_unlock(&admit_mutex);
+    if (status != 0)
+      err_abort(status, "Unlock mutex");
+  }
+}
+
+/*
+ * Decide a probe: a request that replaces a pending alarm is
+ * counted in and returns true, to be filed; any other is handed
+ * back to its submitting thread, and must not be touched again.
+ */
+static bool admit_probed(shard_t *shard, alarm_t *command)
+{
+  int status;
+  bool replaces = number_find(shard, command->messageNumber) != NULL;
+
+  if (replaces)
+  {
+    command->probe = false;
+    atomic_fetch_add(&admitted, 1);
+    atomic_fetch_add(&admitted_bytes, command->length);
+  }
+  status = pthread_mutex_lock(&admit_mutex);
+  if (status != 0)
+    err_abort(status, "Lock mutex");
+  admit_verdict = replaces ? 1 : -1;
+  status = pthread_cond_broadcast(&admit_cond);
+  if (status != 0)
+    err_abort(status, "Broadcast cond");
+  status = pthread_mutex_unlock(&admit_mutex);
+  if (status != 0)
+    err_abort(status, "Unlock mutex");
+  return replaces;
+}
+
+static bool evict_before(const evict_entry_t *a, const evict_entry_t *b)
+{
+  if (a->time != b->time)
+    return a->time > b->time;
+  return a->seq > b->seq;
+}
+
+static void evict_sift_down(evict_entry_t *heap, int count, int index)
+{
+  evict_entry_t entry = heap[index];
+  int child;
+
+  while ((child = 2 * index + 1) < count)
+  {
+    if (child + 1 < count && evict_before(&heap[child + 1], &heap[child]))
+      child++;
+    if (!evict_before(&heap[child], &entry))
+      break;
+    heap[index] = heap[child];
+    index = child;
+  }
+  heap[index] = entry;
+}
+
+/*
+ * Whether an eviction heap entry still stands for a pending alarm.
+ * The alarm may have been freed and reused since; slabs are never
+ * given back, so it can still be looked at.
+ */
+static bool evict_live(shard_t *shard, const evict_entry_t *entry)
+{
+  return number_find(shard, entry->alarm->messageNumber) == entry->alarm &&
+         entry->alarm->seq == entry->seq;
+}
+
+/*
+ * Add an entry for an alarm that has just been filed or given a
+ * new time to its shard's eviction heap.
+ */
+void evict_note(shard_t *shard, alarm_t *alarm)
+{
+  evict_entry_t *heap, entry;
+  int index, parent, i;
+
+  if (admit_policy != ADMIT_EVICT)
+    return;
+  if (shard->evict_count >= 2 * shard->count + 64)
+  {
+    for (i = index = 0; i < shard->evict_count; i++)
+      if (evict_live(shard, &shard->evict[i]))
+        shard->evict[index++] = shard->evict[i];
+    shard->evict_count = index;
+    for (i = index / 2 - 1; i >= 0; i--)
+      evict_sift_down(shard->evict, index, i);
+  }
+  if (shard->evict_count == shard->evict_size)
+  {
+    shard->evict_size = shard->evict_size == 0 ? 64 : 2 * shard->evict_size;
+    heap = realloc(shard->evict, shard->evict_size * sizeof(evict_entry_t));
+    if (heap == NULL)
+      errno_abort("Grow eviction heap");
+    shard->evict = heap;
+  }
+  entry.time = alarm->time;
+  entry.seq = alarm->seq;
+  entry.alarm = alarm;
+  heap = shard->evict;
+  for (index = shard->evict_count++; index > 0; index = parent)
+  {
+    parent = (index - 1) / 2;
+    if (!evict_before(&entry, &heap[parent]))
+      break;
+    heap[index] = heap[parent];
+  }
+  heap[index] = entry;
+}
+
+/*
+ * Take the pending alarm with the farthest deadline off a shard's
+ * eviction heap, or return NULL if the shard has none.
+ */
+static alarm_t *evict_take(shard_t *shard)
+{
+  evict_entry_t entry;
+
+  while (shard->evict_count > 0)
+  {
+    entry = shard->evict[0];
+    shard->evict[0] = shard->evict[--shard->evict_count];
+    evict_sift_down(shard->evict, shard->evict_count, 0);
+    if (evict_live(shard, &entry))
+      return entry.alarm;
+  }
+  return NULL;
+}
+
+/*
+ * Take a pending alarm out of the scheduler and the indexes, and
+ * free it.
+ */
+void alarm_discard(shard_t *shard, alarm_t *alarm)
+{
+  sched->remove(shard->queue, alarm);
+  shard_count_add(shard, -1);
+  alarm_index_remove(shard, alarm);
+  admit_release(shard, alarm);
+  alarm_free(alarm);
+}
+
+/*
+ * The most alarms a display thread prints between looks at its
+ * "paused" flag, so that a pause takes effect promptly even in the
+ * middle of a long backlog.
+ */
+#define WORKER_BATCH 64
+
+/*
+ * The display thread's start routine: wait for expired alarms of
+ * its message type and print them, up to WORKER_BATCH at a time.
+ * While the worker is paused it sleeps on its own condition
+ * variable and nothing else is disturbed.
+ */
+void *worker_thread(void *arg)
+{
+  worker_t *worker = arg;
+  alarm_t *alarm, *batch;
+  char delay[32];
+  int status, count;
+
+  status = pthread_mutex_lock(&worker->mutex);
+  if (status != 0)
+    err_abort(status, "Lock worker");
+  while (1)
+  {
+    while (worker->queue == NULL || worker->paused)
+    {
+      if (worker->busy)
+      {
+        worker->busy = false;
+        status = pthread_cond_broadcast(&worker->drained);
+        if (status != 0)
+          err_abort(status, "Broadcast worker");
+      }
+      status = pthread_cond_wait(&worker->cond, &worker->mutex);
+      if (status != 0)
+        err_abort(status, "Wait on worker");
+    }
+    batch = alarm = worker->queue;
+    for (count = 1; count < WORKER_BATCH && alarm->link != NULL; count++)
+      alarm = alarm->link;
+    worker->queue = alarm->link;
+    alarm->link = NULL;
+    if (worker->queue == NULL)
+      worker->queue_tail = &worker->queue;
+    worker->busy = true;
+    status = pthread_mutex_unlock(&worker->mutex);
+    if (status != 0)
+      err_abort(status, "Unlock worker");
+    log_hold();
+    for (alarm = batch; alarm != NULL; alarm = batch)
+    {
+      batch = alarm->link;
+      format_seconds(delay, sizeof(delay), alarm->delay);
+      log_printf("Display Thread For Message Type %d: (%s) %s\n",
+                 worker->messageType, delay, alarm->message);
+      alarm_free(alarm);
+    }
+    log_release();
+    status = pthread_mutex_lock(&worker->mutex);
+    if (status != 0)
+      err_abort(status, "Lock worker");
+  }
+}
+
+/*
+ * Start a display thread for a message type.
+ */
+worker_t *worker_create(int messageType)
+{
+  worker_t *worker;
+  int status;
+
+  worker = calloc(1, sizeof(worker_t));
+  if (worker == NULL)
+    errno_abort("Allocate worker");
+  worker->messageType = messageType;
+  worker->queue_tail = &worker->queue;
+  worker->batches = calloc(shard_count, sizeof(worker_batch_t));
+  if (worker->batches == NULL)
+    errno_abort("Allocate worker");
+  status = pthread_mutex_init(&worker->mutex, NULL);
+  if (status != 0)
+    err_abort(status, "Init worker mutex");
+  status = pthread_cond_init(&worker->cond, NULL);
+  if (status != 0)
+    err_abort(status, "Init worker cond");
+  status = pthread_cond_init(&worker->drained, NULL);
+  if (status != 0)
+    err_abort(status, "Init worker cond");
+  status = pthread_create(&worker->thread, place_attr(-1), worker_thread, worker);
+  if (status != 0)
+    err_abort(status, "Create display thread");
+  return worker;
+}
+
+/*
+ * Park or release a display thread. A released worker works off
+ * whatever piled up on its queue while it was paused.
+ */
+void worker_pause(worker_t *worker, bool paused)
+{
+  int status;
+
+  status = pthread_mutex_lock(&worker->mutex);
+  if (status != 0)
+    err_abort(status, "Lock worker");
+  worker->paused = paused;
+  if (!paused)
+  {
+    status = pthread_cond_signal(&worker->cond);
+    if (status != 0)
+      err_abort(status, "Signal worker");
+  }
+  else
+  {
+    status = pthread_cond_broadcast(&worker->drained);
+    if (status != 0)
+      err_abort(status, "Broadcast worker");
+  }
+  status = pthread_mutex_unlock(&worker->mutex);
+  if (status != 0)
+    err_abort(status, "Unlock worker");
+}
+
+/*
+ * Add an expired alarm to the batch for its worker in the current
+ * expiry pass of a shard, and the worker to "workers" if it had no
+ * batch yet.
+ */
+void worker_collect(shard_t *shard, worker_t *worker, worker_t **workers, alarm_t *alarm)
+{
+  worker_batch_t *chain = &worker->batches[shard->id];
+
+  if (chain->head == NULL)
+  {
+    chain->tail = &chain->head;
+    chain->next = *workers;
+    *workers = worker;
+  }
+  alarm->link = NULL;
+  *chain->tail = alarm;
+  chain->tail = &alarm->link;
+}
+
+/*
+ * Hand each worker the batch of alarms collected for it during an
+ * expiry pass of a shard, with one lock and one signal per worker.
+ */
+void worker_dispatch(shard_t *shard, worker_t *workers)
+{
+  worker_t *worker;
+  worker_batch_t *batch;
+  int status;
+
+  for (worker = workers; worker != NULL; worker = batch->next)
+  {
+    batch = &worker->batches[shard->id];
+    status = pthread_mutex_lock(&worker->mutex);
+    if (status != 0)
+      err_abort(status, "Lock worker");
+    *worker->queue_tail = batch->head;
+    worker->queue_tail = batch->tail;
+    batch->head = NULL;
+    if (!worker->paused)
+    {
+      status = pthread_cond_signal(&worker->cond);
+      if (status != 0)
+        err_abort(status, "Signal worker");
+    }
+    status = pthread_mutex_unlock(&worker->mutex);
+    if (status != 0)
+      err_abort(status, "Unlock worker");
+  }
+}
+
+/*
+ * Wait until every display thread that is not paused has printed
+ * every alarm handed to it, so that none is lost when the program
+ * exits. A paused worker's queue is left as it is.
+ */
+void worker_drain(void)
+{
+  msgtype_t *mtype;
+  worker_t *worker;
+  int status, i;
+
+  status = pthread_rwlock_rdlock(&type_lock);
+  if (status != 0)
+    err_abort(status, "Lock registry");
+  for (i = 0; type_index != NULL && i < 1 << type_bits; i++)
+    for (mtype = type_index[i]; mtype != NULL; mtype = mtype->hash_next)
+    {
+      worker = atomic_load_explicit(&mtype->worker, memory_order_acquire);
+      if (worker == NULL)
+        continue;
+      status = pthread_mutex_lock(&worker->mutex);
+      if (status != 0)
+        err_abort(status, "Lock worker");
+      while (worker->busy || (worker->queue != NULL && !worker->paused))
+      {
+        status = pthread_cond_wait(&worker->drained, &worker->mutex);
+        if (status != 0)
+          err_abort(status, "Wait on worker");
+      }
+      status = pthread_mutex_unlock(&worker->mutex);
+      if (status != 0)
+        err_abort(status, "Unlock worker");
+    }
+  status = pthread_rwlock_unlock(&type_lock);
+  if (status != 0)
+    err_abort(status, "Unlock registry");
+}
+
+/*
+ * Durability.
+ *
+ * With "-d directory", each shard's alarm thread records every
+ * change to its pending alarms in a write-ahead log of its own,
+ * "wal.<shards>.<shard>": a 'P' record holds a whole Type A alarm,
+ * filed, replacing or rescheduled, a 'D' record the message number
+ * of one that expired or was cancelled, and, in shard 0 only, a 'T'
+ * record whether a message type has a display thread and whether
+ * it is paused. Deadlines are stored on CLOCK_REALTIME, since
+ * CLOCK_MONOTONIC starts over when the machine does. Each record
+ * carries its length and a checksum, so a record torn by a crash
+ * ends the log.
+ *
+ * Records are gathered in "wal" while the alarm thread works, and
+ * written and synced once, with fdatasync(), before it sleeps: all
+ * the commands it took in one go share a single sync, and a crash
+ * loses at most those it was carrying out. An expiry is logged the
+ * same way, so an alarm that expired just before a crash may be
+ * printed again after it.
+ *
+ * Once a log passes WAL_COMPACT bytes, the alarm thread writes
+ * every pending alarm, in the same record format, into a new
+ * "snapshot.<shards>.<shard>" and empties the log. The snapshot is
+ * written to a temporary file and renamed into place, and the log
+ * emptied only after that, so there is always a snapshot and a log
+ * from which the state can be rebuilt: since the last record for a
+ * message number or type in the log is its latest state, replaying
+ * a log on top of a newer snapshot still ends in the right state.
+ */
+#define RECORD_BUFFER (1 << 20)
+#define WAL_COMPACT ((int64_t)64 << 20)
+#define SNAPSHOT_MAGIC "ALRMSNP1"
+#define SNAPSHOT_HEADER 16 /* the magic, then the number of alarms */
+#define RECORD_WORKER 1
+#define RECORD_PAUSED 2
+
+typedef struct record_tag
+{
+  uint32_t length; /* of the record, a multiple of 8 bytes */
+  uint32_t check;  /* record_check() of the rest of the record */
+  int64_t deadline; /* CLOCK_REALTIME nanoseconds */
+  int64_t delay;
+  int32_t messageType;
+  int32_t messageNumber;
+  uint8_t kind;
+  uint8_t flags;
+  uint16_t size; /* bytes of message after the record */
+  uint32_t unused;
+  int64_t period;
+  int64_t until; /* CLOCK_REALTIME nanoseconds, or 0 */
+} record_t;
+
+#define RECORD_MAX (sizeof(record_t) + ALARM_MESSAGE + 8)
+
+const char *durable_dir = NULL;
+
+/*
+ * Records are whole 8-byte words, so the checksum is FNV-1a taken
+ * a word rather than a byte at a time, folded to 32 bits.
+ */
+static uint32_t record_check(const record_t *record)
+{
+  const uint64_t *p = (const uint64_t *)record + 1;
+  const uint64_t *end = (const uint64_t *)((const char *)record + record->length);
+  uint64_t hash = 14695981039346656037ull;
+
+  for (; p < end; p++)
+    hash = (hash ^ *p) * 1099511628211ull;
+  return (uint32_t)(hash ^ (hash >> 32));
+}
+
+record_out_t *out_create(int fd)
+{
+  record_out_t *out;
+
+  out = calloc(1, sizeof(record_out_t));
+  if (out == NULL || (out->buffer = malloc(RECORD_BUFFER)) == NULL)
+    errno_abort("Allocate record buffer");
+  out->fd = fd;
+  out->offset = clock_offset();
+  return out;
+}
+
+static void out_drain(record_out_t *out)
+{
+  size_t done = 0;
+  ssize_t count;
+
+  while (done < out->used)
+  {
+    count = write(out->fd, out->buffer + done, out->used - done);
+    if (count < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      errno_abort("Write durable file");
+    }
+    done += count;
+  }
+  out->bytes += out->used;
+  out->used = 0;
+}
+
+/*
+ * Append a record: of "alarm", if there is one, or of a message
+ * number or type alone.
+ */
+static void out_record(record_out_t *out, int kind, int flags,
+                       int messageType, int messageNumber, const alarm_t *alarm)
+{
+  record_t *record;
+  size_t size = 0, length;
+
+  if (out->used + RECORD_MAX > RECORD_BUFFER)
+    out_drain(out);
+  record = (record_t *)(out->buffer + out->used);
+  if (alarm != NULL)
+    size = alarm->length;
+  length = (sizeof(record_t) + size + 7) & ~(size_t)7;
+  memset(record, 0, length);
+  record->length = length;
+  record->kind = kind;
+  record->flags = flags;
+  record->messageType = messageType;
+  record->messageNumber = messageNumber;
+  if (alarm != NULL)
+  {
+    record->deadline = alarm->time + out->offset;
+    record->delay = alarm->delay;
+    record->period = alarm->period;
+    record->until = alarm->until == 0 ? 0 : alarm->until + out->offset;
+    record->size = size;
+    memcpy(record + 1, alarm->message, size);
+  }
+  record->check = record_check(record);
+  out->used += length;
+}
+
+void wal_put(shard_t *shard, const alarm_t *alarm)
+{
+  if (shard->wal != NULL)
+    out_record(shard->wal, 'P', 0, alarm->messageType, alarm->messageNumber, alarm);
+}
+
+void wal_delete(shard_t *shard, int messageNumber)
+{
+  if (shard->wal != NULL)
+    out_record(shard->wal, 'D', 0, 0, messageNumber, NULL);
+}
+
+static int type_flags(const msgtype_t *mtype)
+{
+  return (atomic_load(&mtype->worker) != NULL ? RECORD_WORKER : 0) |
+         (mtype->paused ? RECORD_PAUSED : 0);
+}
+
+void wal_type(shard_t *shard, const msgtype_t *mtype)
+{
+  if (shard->wal != NULL)
+    out_record(shard->wal, 'T', type_flags(mtype), mtype->messageType, 0, NULL);
+}
+
+/*
+ * Name a shard's snapshot or log, as written for "count" shards.
+ */
+void durable_path(char *path, size_t size, const char *name, int count, int shard)
+{
+  snprintf(path, size, "%s/%s.%d.%d", durable_dir, name, count, shard);
+}
+
+/*
+ * Sync a file's directory, so that a file created or renamed in
+ * it survives a crash.
+ */
+void durable_sync_dir(void)
+{
+  int fd;
+
+  fd = open(durable_dir, O_RDONLY);
+  if (fd < 0 || fsync(fd) != 0)
+    errno_abort("Sync durable directory");
+  close(fd);
+}
+
+/*
+ * Write every pending alarm of a shard (and, for shard 0, every
+ * message type with a display thread) into a new snapshot, then
+ * empty the shard's log.
+ */
+void snapshot_write(shard_t *shard)
+{
+  char path[PATH_MAX], temp[PATH_MAX + 8];
+  record_out_t *out;
+  alarm_t *alarm;
+  msgtype_t *mtype;
+  int fd, status, i;
+
+  durable_path(path, sizeof(path), "snapshot", shard_count, shard->id);
+  snprintf(temp, sizeof(temp), "%s.tmp", path);
+  fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    errno_abort("Create snapshot");
+  out = out_create(fd);
+  memcpy(out->buffer, SNAPSHOT_MAGIC, 8);
+  *(int64_t *)(out->buffer + 8) = shard->count;
+  out->used = SNAPSHOT_HEADER;
+  if (shard->id == 0)
+  {
+    status = pthread_rwlock_rdlock(&type_lock);
+    if (status != 0)
+      err_abort(status, "Lock registry");
+    for (i = 0; type_count > 0 && i < 1 << type_bits; i++)
+      for (mtype = type_index[i]; mtype != NULL; mtype = mtype->hash_next)
+        if (type_flags(mtype) != 0)
+          out_record(out, 'T', type_flags(mtype), mtype->messageType, 0, NULL);
+    status = pthread_rwlock_unlock(&type_lock);
+    if (status != 0)
+      err_abort(status, "Unlock registry");
+  }
+  for (alarm = sched->first(shard->queue); alarm != NULL;
+       alarm = sched->next(shard->queue, alarm))
+    out_record(out, 'P', 0, alarm->messageType, alarm->messageNumber, alarm);
+  out_drain(out);
+  if (fsync(fd) != 0)
+    errno_abort("Sync snapshot");
+  close(fd);
+  free(out->buffer);
+  free(out);
+  if (rename(temp, path) != 0)
+    errno_abort("Rename snapshot");
+  durable_sync_dir();
+  /*
+   * The snapshot holds everything the log did, including what is
+   * still in its buffer.
+   */
+  if (shard->wal != NULL)
+  {
+    if (ftruncate(shard->wal->fd, 0) != 0)
+      errno_abort("Empty log");
+    shard->wal->used = 0;
+    shard->wal->bytes = 0;
+  }
+}
+
+/*
+ * Make what a shard's alarm thread has done so far durable: called
+ * before it sleeps.
+ */
+void wal_sync(shard_t *shard)
+{
+  record_out_t *wal = shard->wal;
+
+  if (wal == NULL || wal->used == 0)
+    return;
+  out_drain(wal);
+  if (fdatasync(wal->fd) != 0)
+    errno_abort("Sync log");
+  counter_bump(&shard->wal_syncs);
+  wal->offset = clock_offset();
+  if (wal->bytes >= WAL_COMPACT)
+    snapshot_write(shard);
+}
+
+/*
+ * File an alarm in a shard's scheduler and indexes, in place of
+ * "old", the pending alarm with the same message number, if any.
+ */
+void alarm_file(shard_t *shard, alarm_t *alarm, alarm_t *old)
+{
+  if (old != NULL)
+    alarm_discard(shard, old);
+  alarm->seq = shard->seq++;
+  sched->insert(shard->queue, alarm);
+  shard_count_add(shard, 1);
+  counter_bump(&shard->inserted);
+  alarm_index_add(shard, alarm);
+  evict_note(shard, alarm);
+}
+
+/*
+ * Insert alarm entry into a shard's scheduler, replacing any
+ * pending Type A alarm with the same message number.
+ */
+void alarm_insert(shard_t *shard, alarm_t *alarm)
+{
+  alarm_t *next;
+  int64_t start = stats_clock();
+
+  /*
+   * LOCKING PROTOCOL:
+   *
+   * This routine must only be called by the shard's alarm
+   * thread, which owns the shard's scheduler and indexes.
+   */
+  next = number_find(shard, alarm->messageNumber);
+  if (next != NULL)
+    log_printf("Type A Replacement Alarm Request With Message Number %d Inserted Into Alarm List at %lld: %c\n", alarm->messageNumber, clock_time(), alarm->type);
+  else
+    log_printf("Type A Alarm Request With Message Number %d Inserted Into Alarm List at %lld: %c\n", alarm->messageNumber, clock_time(), alarm->type);
+  alarm_file(shard, alarm, next);
+  wal_put(shard, alarm);
+  if (alarm->evicts && next == NULL && (next = evict_take(shard)) != NULL)
+  {
+    log_printf("Type A Alarm Request With Message Number %d Evicted From Alarm List at %lld: %c\n", next->messageNumber, clock_time(), next->type);
+    wal_delete(shard, next->messageNumber);
+    alarm_discard(shard, next);
+  }
+  stats_record(insert, stats_clock() - start);
+#ifdef DEBUG
+  printf("[%s: ", sched->name);
+  for (next = sched->first(shard->queue); next != NULL;
+       next = sched->next(shard->queue, next))
+    printf("%lld(%lld)[\"%s\"] ", (long long)next->time,
+           (long long)(next->time - clock_now()), next->message);
+  printf("]\n");
+#endif
+}
+
+/*
+ * Bulk requests.
+ *
+ * A Cancel or Reschedule of a whole message type or time window is
+ * carried out by every shard, each in a single pass over its own
+ * alarms: a Type's alarms are found through the shard's list for
+ * the type, and a window's through the scheduler's "range", so
+ * neither walks alarms it does not apply to. The pass runs in the
+ * shard's alarm thread between other commands, so nothing else in
+ * the shard sees it half done.
+ */
+
+/*
+ * Make another shard's copy of a bulk request.
+ */
+alarm_t *bulk_copy(const alarm_t *command)
+{
+  alarm_t *copy;
+
+  copy = alarm_alloc(command->node);
+  copy->type = command->type;
+  copy->bulk = command->bulk;
+  copy->evicts = copy->probe = false;
+  return copy;
+}
+
+/*
+ * Move a pending alarm by "delta"; it keeps its place in the
+ * indexes.
+ */
+static void alarm_move(shard_t *shard, alarm_t *alarm, int64_t delta)
+{
+  alarm->delay = alarm->delay + delta < 0 ? 0 : alarm->delay + delta;
+  if (alarm->until != 0)
+    alarm->until += delta;
+  alarm->seq = shard->seq++;
+  sched->retime(shard->queue, alarm, alarm->time + delta);
+  evict_note(shard, alarm);
+  wal_put(shard, alarm);
+}
+
+/*
+ * Report a bulk request once every shard has carried it out.
+ */
+static void bulk_report(bulk_t *bulk)
+{
+  char what[80], from[32], to[32], delta[32];
+  int matched = atomic_load(&bulk->matched);
+
+  if (bulk->scope == 'T')
+    snprintf(what, sizeof(what), "With Message Type %d", bulk->messageType);
+  else
+  {
+    format_seconds(from, sizeof(from), bulk->from - bulk->issued);
+    format_seconds(to, sizeof(to), bulk->to - bulk->issued);
+    snprintf(what, sizeof(what), "With Window (%s, %s)", from, to);
+  }
+  if (bulk->type == 'C')
+    log_printf("Type C Cancel Alarm Request %s Inserted Into Alarm List at %lld: %d Alarms Cancelled\n",
+               what, clock_time(), matched);
+  else
+  {
+    format_seconds(delta, sizeof(delta), bulk->delta < 0 ? -bulk->delta : bulk->delta);
+    log_printf("Reschedule Alarm Request %s Inserted Into Alarm List at %lld: %d Alarms Moved By %s%s Seconds\n",
+               what, clock_time(), matched, bulk->delta < 0 ? "-" : "", delta);
+  }
+  free(bulk);
+}
+
+/*
+ * Carry out a shard's copy of a bulk request.
+ */
+void bulk_apply(shard_t *shard, bulk_t *bulk)
+{
+  typelist_t *tlist;
+  alarm_t *alarm, *next;
+  int i, matched = 0;
+
+  if (bulk->scope == 'T')
+  {
+    /*
+     * Cancelling the last alarm of the type frees the list, so
+     * the next alarm is found before this one is dealt with.
+     */
+    tlist = tlist_find(shard, bulk->messageType);
+    for (alarm = tlist != NULL ? tlist->alarms : NULL; alarm != NULL; alarm = next)
+    {
+      next = alarm->type_next;
+      if (bulk->type == 'C')
+      {
+        wal_delete(shard, alarm->messageNumber);
+        alarm_discard(shard, alarm);
+      }
+      else
+        alarm_move(shard, alarm, bulk->delta);
+      matched++;
+    }
+  }
+  else
+  {
+    shard->found.count = 0;
+    sched->range(shard->queue, bulk->from, bulk->to, &shard->found);
+    for (i = 0; i < shard->found.count; i++)
+      if (bulk->type == 'C')
+      {
+        wal_delete(shard, shard->found.items[i]->messageNumber);
+        alarm_discard(shard, shard->found.items[i]);
+      }
+      else
+        alarm_move(shard, shard->found.items[i], bulk->delta);
+    matched = shard->found.count;
+  }
+  atomic_fetch_add(&bulk->matched, matched);
+  if (atomic_fetch_sub(&bulk->shards, 1) == 1)
+    bulk_report(bulk);
+}
+
+/*
+ * Check a Create_Thread, Pause_Thread or Resume_Thread request
+ * against its message type's record, if there is one. Returns the
+ * format of the error message, or NULL if the request can be
+ * carried out. The caller must hold type_lock.
+ */
+static const char *type_error(const alarm_t *command, const msgtype_t *mtype)
+{
+  switch (command->type)
+  {
+  case 'B':
+    if (mtype == NULL || atomic_load(&mtype->count) == 0)
+      return "Type B Alarm Request Error: No Alarm Request With Message Type %d!\n";
+    if (atomic_load(&mtype->worker) != NULL)
+      return "Error: More Than One Type B Alarm Request With Message Type %d!\n";
+    break;
+  case 'D':
+    if (mtype == NULL || atomic_load(&mtype->worker) == NULL)
+      return "Type D Alarm Request Error: No Display Thread For Message Type %d!\n";
+    if (mtype->paused)
+      return "Error: More Than One Type D Alarm Request With Message Type %d!\n";
+    break;
+  case 'E':
+    if (mtype == NULL || !mtype->paused)
+      return "Type E Alarm Request Error: No Type D Pause Alarm Request With Message Type %d!\n";
+    break;
+  }
+  return NULL;
+}
+
+/*
+ * Carry out one submitted command in a shard. A Type A alarm is
+ * inserted, unless it is a probe that replaces nothing; every
+ * other command is checked against the indexes, applied, and
+ * freed. A request for a message type is checked with type_lock
+ * shared; only one that passes takes it exclusively, and is
+ * checked again, since another shard may have changed the type in
+ * between.
+ */
+void alarm_command(shard_t *shard, alarm_t *command)
+{
+  msgtype_t *mtype;
+  alarm_t *alarm;
+  const char *error;
+  int status;
+
+  switch (command->type)
+  {
+  case 'A':
+    if (!command->probe || admit_probed(shard, command))
+      alarm_insert(shard, command);
+    return;
+  case 'C':
+  case 'R':
+    if (command->bulk != NULL)
+    {
+      bulk_apply(shard, command->bulk);
+      alarm_free(command);
+      return;
+    }
+    alarm = number_find(shard, command->messageNumber);
+    if (alarm == NULL)
+      log_printf("Error: No Alarm Request With Message Number %d to Cancel!\n", command->messageNumber);
+    else
+    {
+      wal_delete(shard, alarm->messageNumber);
+      alarm_discard(shard, alarm);
+      log_printf("Type C Cancel Alarm Request With Message Number %d Inserted Into Alarm List at %lld: %c\n", command->messageNumber, clock_time(), command->type);
+    }
+    alarm_free(command);
+    return;
+  case 'S':
+    admit_flush(shard);
+    stats_dump();
+    alarm_free(command);
+    return;
+  }
+  status = pthread_rwlock_rdlock(&type_lock);
+  if (status != 0)
+    err_abort(status, "Lock registry");
+  error = type_error(command, type_find(command->messageType));
+  if (error == NULL)
+  {
+    status = pthread_rwlock_unlock(&type_lock);
+    if (status != 0)
+      err_abort(status, "Unlock registry");
+    status = pthread_rwlock_wrlock(&type_lock);
+    if (status != 0)
+      err_abort(status, "Lock registry");
+    mtype = type_find(command->messageType);
+    error = type_error(command, mtype);
+  }
+  if (error != NULL)
+    log_printf(error, command->messageType);
+  else
+    switch (command->type)
+    {
+    case 'B':
+      atomic_store(&mtype->worker, worker_create(command->messageType));
+      wal_type(shard, mtype);
+      log_printf("Type B Create Thread Alarm Request For Message Type %d Inserted Into Alarm List at %lld!\n", command->messageType, clock_time());
+      break;
+    case 'D':
+      mtype->paused = true;
+      worker_pause(atomic_load(&mtype->worker), true);
+      wal_type(shard, mtype);
+      log_printf("Type D Pause Thread Alarm Request For Message Type %d Inserted Into Alarm List at %lld!\n", command->messageType, clock_time());
+      break;
+    case 'E':
+      mtype->paused = false;
+      worker_pause(atomic_load(&mtype->worker), false);
+      wal_type(shard, mtype);
+      log_printf("Type E Resume Thread Alarm Request For Message Type %d Inserted Into Alarm List at %lld!\n", command->messageType, clock_time());
+      break;
+    }
+  status = pthread_rwlock_unlock(&type_lock);
+  if (status != 0)
+    err_abort(status, "Unlock registry");
+  alarm_free(command);
+}
+
+/*
+ * Event wait.
+ *
+ * With "-w epoll", each alarm thread sleeps in epoll_wait() on its
+ * shard's "epoll_fd" instead of in a timed condition wait. The
+ * epoll set holds a timerfd, armed at the absolute CLOCK_MONOTONIC
+ * time of the scheduler's next deadline, and an eventfd that a
+ * producer writes when its push finds the submit stack empty, in
+ * place of signalling "cond". The alarm thread reads the eventfd
+ * as soon as it wakes, before it takes the stack, so a push that
+ * lands after the take always finds the stack empty and writes the
+ * eventfd again: no wakeup is lost, and no producer takes the
+ * shard's mutex. The timerfd is only re-armed when the deadline
+ * changes, so a preempting submission costs one timerfd_settime()
+ * rather than a mutex and condition variable round trip. Other
+ * descriptors can be waited for in the same epoll set.
+ */
+#ifdef __linux__
+static void event_add(shard_t *shard, int fd)
+{
+  struct epoll_event event;
+
+  event.events = EPOLLIN;
+  event.data.fd = fd;
+  if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0)
+    errno_abort("Add to epoll set");
+}
+
+void event_init(shard_t *shard)
+{
+  shard->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (shard->epoll_fd < 0)
+    errno_abort("Create epoll set");
+  shard->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (shard->timer_fd < 0)
+    errno_abort("Create timerfd");
+  shard->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (shard->event_fd < 0)
+    errno_abort("Create eventfd");
+  event_add(shard, shard->timer_fd);
+  event_add(shard, shard->event_fd);
+}
+
+/*
+ * Wake a shard's alarm thread from epoll_wait(). This may be
+ * called from any thread.
+ */
+void event_notify(shard_t *shard)
+{
+  uint64_t one = 1;
+
+  if (write(shard->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    errno_abort("Write eventfd");
+}
+
+/*
+ * Sleep in epoll_wait() until "wake" (0 for no time limit), or
+ * until a command is submitted. Returns whether the timer expired.
+ * On a clock that does not move by itself, the timerfd is left
+ * alone and the clock skips to "wake" instead, once it can.
+ */
+static bool event_wait(shard_t *shard, int64_t wake)
+{
+  struct itimerspec timer = {{0, 0}, {0, 0}};
+  struct epoll_event events[2];
+  uint64_t value;
+  int64_t locked;
+  int status, count, i;
+  bool timed_out = false, submitted = false;
+
+  /*
+   * The idle handshake with wait_idle() is the same as in
+   * cond_wait(); only the sleep itself is done outside the mutex.
+   */
+  locked = mutex_lock(&shard->mutex, &alarm_lock_stats);
+  if (atomic_load(&shard->submit_head) == NULL)
+  {
+    if (shard->input_done && (wake == 0 || !shard->wait_alarms))
+    {
+      shard->idle = true;
+      status = pthread_cond_signal(&shard->idle_cond);
+      if (status != 0)
+        err_abort(status, "Signal cond");
+    }
+    timed_out = wake != 0 && clock_source->skip != NULL &&
+                clock_source->skip(shard, wake);
+  }
+  mutex_unlock(&shard->mutex, locked);
+  if (timed_out)
+    return true;
+  if (wake != shard->armed && clock_source->skip == NULL)
+  {
+    timer.it_value.tv_sec = wake / NSEC_PER_SEC;
+    timer.it_value.tv_nsec = wake % NSEC_PER_SEC;
+    if (timerfd_settime(shard->timer_fd, TFD_TIMER_ABSTIME, &timer, NULL) != 0)
+      errno_abort("Arm timerfd");
+    shard->armed = wake;
+  }
+  while (!timed_out && !submitted)
+  {
+    count = epoll_wait(shard->epoll_fd, events, 2, -1);
+    if (count < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      errno_abort("Wait for events");
+    }
+    for (i = 0; i < count; i++)
+    {
+      if (events[i].data.fd == shard->timer_fd)
+      {
+        if (read(shard->timer_fd, &value, sizeof(value)) > 0)
+        {
+          timed_out = true;
+          shard->armed = 0;
+        }
+      }
+      else if (read(shard->event_fd, &value, sizeof(value)) > 0)
+        submitted = true;
+    }
+  }
+  if (!timed_out)
+    counter_bump(atomic_load(&shard->submit_head) != NULL ? &shard->wake.submit : &shard->wake.spurious);
+  return timed_out;
+}
+#else
+void event_init(shard_t *shard)
+{
+  fprintf(stderr, "-w epoll needs Linux\n");
+  exit(1);
+}
+
+void event_notify(shard_t *shard)
+{
+}
+
+static bool event_wait(shard_t *shard, int64_t wake)
+{
+  return false;
+}
+#endif
+
+/*
+ * Allocate and initialize a shard, on a cache line boundary of its
+ * own and, with "-p", on its alarm thread's node. "cond_attr" times
+ * the condition wait on CLOCK_MONOTONIC.
+ */
+shard_t *shard_create(int id, pthread_condattr_t *cond_attr)
+{
+  void *memory;
+  shard_t *shard;
+  int status, cpu = place_cpu(id);
+
+  place_self(cpu);
+  status = posix_memalign(&memory, 64, sizeof(shard_t));
+  if (status != 0)
+    err_abort(status, "Allocate shard");
+  shard = memset(memory, 0, sizeof(shard_t));
+  shard->id = id;
+  shard->cpu = cpu;
+  shard->node = cpu < 0 ? 0 : cpu_node(cpu);
+  shard->queue = sched->create();
+  status = pthread_mutex_init(&shard->mutex, NULL);
+  if (status != 0)
+    err_abort(status, "Init mutex");
+  status = pthread_cond_init(&shard->cond, cond_attr);
+  if (status != 0)
+    err_abort(status, "Init cond");
+  status = pthread_cond_init(&shard->idle_cond, NULL);
+  if (status != 0)
+    err_abort(status, "Init cond");
+  if (wait_epoll)
+    event_init(shard);
+  return shard;
+}
+
+/*
+ * Find the shard that owns a message number. The hash is
+ * MurmurHash3's finalizer rather than index_hash, so that the
+ * alarms of one shard still spread over all of its index buckets.
+ */
+shard_t *shard_for(int messageNumber)
+{
+  uint32_t hash = (uint32_t)messageNumber;
+
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35u;
+  hash ^= hash >> 16;
+  return shards[((uint64_t)hash * shard_count) >> 32];
+}
+
+/*
+ * Choose the shard that carries out a command: Type A and Cancel
+ * requests by their message number, everything else, including
+ * shard 0's copy of a bulk request, in shard 0.
+ */
+shard_t *shard_of(const alarm_t *command)
+{
+  if ((command->type != 'A' && command->type != 'C') || command->bulk != NULL)
+    return shards[0];
+  return shard_for(command->messageNumber);
+}
+
+/*
+ * Submit a chain of commands to a shard's alarm thread at once.
+ * The chain runs from "newest" to "oldest" through "link", the
+ * order of the submit stack itself, so it is pushed with a single
+ * compare-and-swap. This may be called from any thread.
+ */
+void alarm_submit_chain(shard_t *shard, alarm_t *newest, alarm_t *oldest)
+{
+  alarm_t *head;
+  int64_t locked;
+  int status;
+
+  head = atomic_load(&shard->submit_head);
+  oldest->link = head;
+  while (!atomic_compare_exchange_weak(&shard->submit_head, &head, newest))
+  {
+    atomic_fetch_add_explicit(&submit_retries, 1, memory_order_relaxed);
+    oldest->link = head;
+  }
+  if (head != NULL)
+    return;
+  if (wait_epoll)
+  {
+    event_notify(shard);
+    return;
+  }
+  locked = mutex_lock(&shard->mutex, &alarm_lock_stats);
+  status = pthread_cond_signal(&shard->cond);
+  if (status != 0)
+    err_abort(status, "Signal cond");
+  mutex_unlock(&shard->mutex, locked);
+}
+
+/*
+ * Submit a command to the alarm thread of its shard, or a bulk
+ * request to every shard. This may be called from any thread.
+ */
+void alarm_submit(alarm_t *command)
+{
+  alarm_t *copy;
+  int i;
+
+  if (command->bulk != NULL)
+    for (i = 1; i < shard_count; i++)
+    {
+      copy = bulk_copy(command);
+      alarm_submit_chain(shards[i], copy, copy);
+    }
+  alarm_submit_chain(shard_of(command), command, command);
+}
+
+/*
+ * Commands collected by one thread for each shard, to be
+ * submitted a chain per shard; see batch_add and batch_submit.
+ */
+typedef struct submit_batch_tag
+{
+  alarm_t *newest;
+  alarm_t *oldest;
+} submit_batch_t;
+
+submit_batch_t *batch_create(void)
+{
+  submit_batch_t *batch;
+
+  batch = calloc(shard_count, sizeof(submit_batch_t));
+  if (batch == NULL)
+    errno_abort("Allocate submit batch");
+  return batch;
+}
+
+static void batch_chain(submit_batch_t *chain, alarm_t *command)
+{
+  command->link = chain->newest;
+  chain->newest = command;
+  if (chain->oldest == NULL)
+    chain->oldest = command;
+}
+
+void batch_add(submit_batch_t *batch, alarm_t *command)
+{
+  int i;
+
+  if (command->bulk != NULL)
+    for (i = 1; i < shard_count; i++)
+      batch_chain(&batch[i], bulk_copy(command));
+  batch_chain(&batch[shard_of(command)->id], command);
+}
+
+void batch_submit(submit_batch_t *batch)
+{
+  int i;
+
+  for (i = 0; i < shard_count; i++)
+    if (batch[i].newest != NULL)
+    {
+      alarm_submit_chain(shards[i], batch[i].newest, batch[i].oldest);
+      batch[i].newest = batch[i].oldest = NULL;
+    }
+}
+
+/*
+ * Count a Type A alarm in, if there is room. Either limit may be
+ * exceeded by a single alarm, so that one that is too big by
+ * itself cannot wait for ever.
+ */
+static bool admit_try(const alarm_t *alarm)
+{
+  long count, bytes;
+
+  count = atomic_fetch_add(&admitted, 1) + 1;
+  bytes = atomic_fetch_add(&admitted_bytes, alarm->length) + alarm->length;
+  if (count == 1 || ((admit_limit == 0 || count <= admit_limit) &&
+                     (admit_byte_limit == 0 || bytes <= admit_byte_limit)))
+    return true;
+  atomic_fetch_sub(&admitted, 1);
+  atomic_fetch_sub(&admitted_bytes, alarm->length);
+  return false;
+}
+
+/*
+ * A virtual clock moves only while its alarm thread has nothing
+ * else to do. Once the input is waiting for room, that is also true
+ * of an alarm thread still expecting commands, so wake each one to
+ * let its clock skip ahead to the alarm that will make room.
+ */
+static void admit_nudge(void)
+{
+  shard_t *shard;
+  int64_t locked;
+  int status, i;
+
+  for (i = 0; i < shard_count; i++)
+  {
+    shard = shards[i];
+    locked = mutex_lock(&shard->mutex, &alarm_lock_stats);
+    if (wait_epoll)
+      event_notify(shard);
+    status = pthread_cond_signal(&shard->cond);
+    if (status != 0)
+      err_abort(status, "Signal cond");
+    mutex_unlock(&shard->mutex, locked);
+  }
+}
+
+/*
+ * Hand a request that found no room to its shard as a probe (see
+ * "Admission control"), and wait for the verdict. Returns true if
+ * the shard took it as a replacement, or false if it is still the
+ * caller's, or another probe was already out.
+ */
+static bool admit_probe(alarm_t *command)
+{
+  int status;
+  bool replaced;
+
+  status = pthread_mutex_lock(&admit_mutex);
+  if (status != 0)
+    err_abort(status, "Lock mutex");
+  if (admit_probing)
+  {
+    status = pthread_mutex_unlock(&admit_mutex);
+    if (status != 0)
+      err_abort(status, "Unlock mutex");
+    return false;
+  }
+  admit_probing = true;
+  admit_verdict = 0;
+  status = pthread_mutex_unlock(&admit_mutex);
+  if (status != 0)
+    err_abort(status, "Unlock mutex");
+  command->probe = true;
+  alarm_submit(command);
+  status = pthread_mutex_lock(&admit_mutex);
+  if (status != 0)
+    err_abort(status, "Lock mutex");
+  while (admit_verdict == 0)
+  {
+    status = pthread_cond_wait(&admit_cond, &admit_mutex);
+    if (status != 0)
+      err_abort(status, "Wait on cond");
+  }
+  replaced = admit_verdict > 0;
+  admit_probing = false;
+  status = pthread_mutex_unlock(&admit_mutex);
+  if (status != 0)
+    err_abort(status, "Unlock mutex");
+  if (!replaced)
+    command->probe = false;
+  return replaced;
+}
+
+/*
+ * Admit a command that is about to be submitted, as the admission
+ * policy says. Returns false if it was refused, and has been freed,
+ * or has already been submitted. Before waiting for room, the
+ * commands collected in "batch", if any, are submitted, since they
+ * may be what has to expire, or what a replacement replaces.
+ */
+bool alarm_admit(alarm_t *command, submit_batch_t *batch)
+{
+  int status;
+
+  if (command->type != 'A' || admit_try(command))
+    return true;
+  if (admit_policy == ADMIT_EVICT)
+  {
+    atomic_fetch_add(&admitted, 1);
+    atomic_fetch_add(&admitted_bytes, command->length);
+    command->evicts = true;
+    return true;
+  }
+  if (admit_policy == ADMIT_REJECT)
+  {
+    log_printf("Error: Too Many Alarms, Alarm Request With Message Number %d Rejected!\n", command->messageNumber);
+    atomic_fetch_sub_explicit(&command->mtype->count, 1, memory_order_relaxed);
+    alarm_free(command);
+    return false;
+  }
+  if (batch != NULL)
+    batch_submit(batch);
+  /*
+   * A replacement is not held up by a full table: it frees what it
+   * takes, give or take the message, so only the shard's verdict
+   * on whether it is one is waited for.
+   */
+  if (admit_probe(command))
+    return false;
+  atomic_fetch_add(&admit_waiters, 1);
+  if (clock_source->skip != NULL)
+    admit_nudge();
+  status = pthread_mutex_lock(&admit_mutex);
+  if (status != 0)
+    err_abort(status, "Lock mutex");
+  while (!admit_try(command))
+  {
+    status = pthread_cond_wait(&admit_cond, &admit_mutex);
+    if (status != 0)
+      err_abort(status, "Wait on cond");
+  }
+  atomic_fetch_sub(&admit_waiters, 1);
+  status = pthread_mutex_unlock(&admit_mutex);
+  if (status != 0)
+    err_abort(status, "Unlock mutex");
+  return true;
+}
+
+/*
+ * Admit a command and add it to "batch".
+ */
+void batch_admit(submit_batch_t *batch, alarm_t *command)
+{
+  if (alarm_admit(command, batch))
+    batch_add(batch, command);
+}
+
+/*
+ * Take every command submitted to a shard, oldest first.
+ */
+static alarm_t *submit_take(shard_t *shard)
+{
+  alarm_t *stack, *list = NULL, *next;
+
+  stack = atomic_exchange(&shard->submit_head, NULL);
+  for (; stack != NULL; stack = next)
+  {
+    next = stack->link;
+    stack->link = list;
+    list = stack;
+  }
+  return list;
+}
+
+/*
+ * Carry out one record of a snapshot or log while restoring, in
+ * whichever shard now owns its message number. "offset" is the
+ * current clock_offset(). A message number appears only once in
+ * the snapshots, so an alarm from a snapshot cannot replace one.
+ */
+static void record_apply(const record_t *record, int64_t offset, bool snapshot)
+{
+  shard_t *shard = shard_for(record->messageNumber);
+  alarm_t *alarm;
+  msgtype_t *mtype;
+  worker_t *worker;
+
+  switch (record->kind)
+  {
+  case 'P':
+    alarm = alarm_alloc(shard->node);
+    alarm->type = 'A';
+    alarm->messageType = record->messageType;
+    alarm->messageNumber = record->messageNumber;
+    alarm->bulk = NULL;
+    alarm->delay = record->delay;
+    alarm->time = record->deadline - offset;
+    alarm->period = record->period;
+    alarm->until = record->until == 0 ? 0 : record->until - offset;
+    message_set(alarm, (const char *)(record + 1), record->size);
+    alarm->evicts = alarm->probe = false;
+    atomic_fetch_add(&admitted, 1);
+    atomic_fetch_add(&admitted_bytes, alarm->length);
+    type_hold(alarm);
+    alarm_file(shard, alarm, snapshot ? NULL : number_find(shard, alarm->messageNumber));
+    break;
+  case 'D':
+    alarm = number_find(shard, record->messageNumber);
+    if (alarm != NULL)
+      alarm_discard(shard, alarm);
+    break;
+  case 'T':
+    mtype = type_get(record->messageType);
+    worker = atomic_load(&mtype->worker);
+    if ((record->flags & RECORD_WORKER) && worker == NULL)
+    {
+      worker = worker_create(mtype->messageType);
+      atomic_store(&mtype->worker, worker);
+    }
+    mtype->paused = worker != NULL && (record->flags & RECORD_PAUSED);
+    if (worker != NULL)
+      worker_pause(worker, mtype->paused);
+    break;
+  }
+}
+
+/*
+ * Map a snapshot or log and carry out each of its records, up to
+ * the first that is damaged. Returns how many bytes were valid, or
+ * -1 if there is no such file. "saved" and "index" say which shard
+ * of how many the file was written for, so that a snapshot's
+ * alarms can be made room for before they are loaded.
+ */
+static off_t restore_file(const char *path, bool snapshot, int64_t offset,
+                          int saved, int index)
+{
+  const record_t *record;
+  char *map, *p, *end;
+  struct stat sb;
+  int64_t count;
+  int fd, i;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+  {
+    if (errno == ENOENT)
+      return -1;
+    errno_abort("Open durable file");
+  }
+  if (fstat(fd, &sb) != 0)
+    errno_abort("Stat durable file");
+  if (sb.st_size == 0)
+  {
+    close(fd);
+    return 0;
+  }
+  map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  if (map == MAP_FAILED)
+    errno_abort("Map durable file");
+  madvise(map, sb.st_size, MADV_SEQUENTIAL);
+  p = map;
+  end = map + sb.st_size;
+  if (snapshot)
+  {
+    if (sb.st_size < SNAPSHOT_HEADER || memcmp(map, SNAPSHOT_MAGIC, 8) != 0)
+    {
+      fprintf(stderr, "%s is not a snapshot\n", path);
+      exit(1);
+    }
+    p += SNAPSHOT_HEADER;
+    /*
+     * The header's count is not checksummed: trust it no further
+     * than the number of records that could fit in the file.
+     */
+    count = *(const int64_t *)(map + 8);
+    if (count < 0 || count > (int64_t)((end - p) / sizeof(record_t)))
+      count = (end - p) / sizeof(record_t);
+  }
+  else
+    count = sb.st_size / (sizeof(record_t) + 8); /* at most */
+  if (saved == shard_count)
+    number_reserve(shards[index], shards[index]->number_count + count);
+  else
+    for (i = 0; i < shard_count; i++)
+      number_reserve(shards[i], shards[i]->number_count +
+                                    count / shard_count + count / 16);
+  while ((size_t)(end - p) >= sizeof(record_t))
+  {
+    record = (const record_t *)p;
+    if (record->length % 8 != 0 || record->length > (size_t)(end - p) ||
+        record->size > ALARM_MESSAGE - 1 ||
+        record->length < sizeof(record_t) + record->size ||
+        record_check(record) != record->check)
+      break;
+    record_apply(record, offset, snapshot);
+    p += record->length;
+  }
+  if (p != end)
+    fprintf(stderr, "%s: ignoring %lld bytes after a damaged record\n",
+            path, (long long)(end - p));
+  munmap(map, sb.st_size);
+  close(fd);
+  return p - map;
+}
+
+/*
+ * Restore the pending alarms from "-d directory", before any alarm
+ * thread runs, and open the shards' logs.
+ *
+ * The file "shards" names the number of shards the snapshots and
+ * logs were written for. If that is not the number running now,
+ * every alarm is rewritten into snapshots for the new number of
+ * shards, with empty logs, and only then is "shards" replaced, by a
+ * rename, and the old files removed; until then the old files are
+ * still the ones that count.
+ */
+void durable_open(const char *dir)
+{
+  char path[PATH_MAX], temp[PATH_MAX + 8], name[16];
+  off_t valid[SHARD_MAX];
+  struct dirent *entry;
+  FILE *file;
+  DIR *handle;
+  int64_t offset = clock_offset();
+  int saved = 0, count, shard, i, fd;
+
+  durable_dir = dir;
+  if (strlen(dir) > PATH_MAX - 32)
+  {
+    fprintf(stderr, "Directory name \"%s\" is too long\n", dir);
+    exit(1);
+  }
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+    errno_abort("Create durable directory");
+  snprintf(path, sizeof(path), "%s/shards", dir);
+  file = fopen(path, "r");
+  if (file != NULL)
+  {
+    if (fscanf(file, "%d", &saved) != 1 || saved < 1 || saved > SHARD_MAX)
+    {
+      fprintf(stderr, "%s is damaged\n", path);
+      exit(1);
+    }
+    fclose(file);
+  }
+  for (i = 0; i < saved; i++)
+  {
+    durable_path(path, sizeof(path), "snapshot", saved, i);
+    restore_file(path, true, offset, saved, i);
+    durable_path(path, sizeof(path), "wal", saved, i);
+    valid[i] = restore_file(path, false, offset, saved, i);
+  }
+  for (i = 0; i < shard_count; i++)
+  {
+    durable_path(path, sizeof(path), "wal", shard_count, i);
+    fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+      errno_abort("Open log");
+    shards[i]->wal = out_create(fd);
+    if (saved != shard_count)
+      snapshot_write(shards[i]);
+    else if (valid[i] >= 0)
+    {
+      if (ftruncate(fd, valid[i]) != 0)
+        errno_abort("Truncate log");
+      shards[i]->wal->bytes = valid[i];
+    }
+  }
+  if (saved == shard_count)
+    return;
+  snprintf(path, sizeof(path), "%s/shards", dir);
+  snprintf(temp, sizeof(temp), "%s.tmp", path);
+  file = fopen(temp, "w");
+  if (file == NULL || fprintf(file, "%d\n", shard_count) < 0 ||
+      fflush(file) != 0 || fsync(fileno(file)) != 0 || fclose(file) != 0)
+    errno_abort("Write shards file");
+  if (rename(temp, path) != 0)
+    errno_abort("Rename shards file");
+  durable_sync_dir();
+  handle = opendir(dir);
+  if (handle == NULL)
+    errno_abort("Open durable directory");
+  while ((entry = readdir(handle)) != NULL)
+    if (sscanf(entry->d_name, "%15[a-z].%d.%d", name, &count, &shard) == 3 &&
+        (strcmp(name, "snapshot") == 0 || strcmp(name, "wal") == 0) &&
+        count != shard_count)
+    {
+      snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+      unlink(path);
+    }
+  closedir(handle);
+}
+
+/*
+ * Sleep in the shard's condition wait until "wake" (0 for no
+ * time limit), or until a command is submitted. Returns whether
+ * the wait timed out. On a clock that does not move by itself,
+ * the wait has no time limit until the clock can skip to "wake".
+ */
+static bool cond_wait(shard_t *shard, int64_t wake)
+{
+  struct timespec cond_time;
+  int64_t locked;
+  int status;
+  bool timed_out = false;
+
+  cond_time.tv_sec = wake / NSEC_PER_SEC;
+  cond_time.tv_nsec = wake % NSEC_PER_SEC;
+  locked = mutex_lock(&shard->mutex, &alarm_lock_stats);
+  while (atomic_load(&shard->submit_head) == NULL)
+  {
+    if (shard->input_done && (wake == 0 || !shard->wait_alarms))
+    {
+      shard->idle = true;
+      status = pthread_cond_signal(&shard->idle_cond);
+      if (status != 0)
+        err_abort(status, "Signal cond");
+    }
+    if (wake != 0 && clock_source->skip != NULL && clock_source->skip(shard, wake))
+    {
+      timed_out = true;
+      break;
+    }
+    stats_record(lock_hold, stats_clock() - locked);
+    if (wake == 0 || clock_source->skip != NULL)
+      status = pthread_cond_wait(&shard->cond, &shard->mutex);
+    else
+      status = pthread_cond_timedwait(
+          &shard->cond, &shard->mutex, &cond_time);
+    locked = stats_clock();
+    if (status == ETIMEDOUT)
+    {
+      timed_out = true;
+      break;
+    }
+    if (status != 0)
+      err_abort(status, "Wait on cond");
+    if (atomic_load(&shard->submit_head) == NULL)
+      counter_bump(&shard->wake.spurious);
+  }
+  if (!timed_out)
+    counter_bump(&shard->wake.submit);
+  mutex_unlock(&shard->mutex, locked);
+  return timed_out;
+}
+
+/*
+ * The time at which a periodic alarm that has just expired is due
+ * again, skipping any expirations the alarm thread was too late
+ * for, or 0 if the alarm is not periodic or its last one is past.
+ * An expiration held back by "-c" is not late, so one that is
+ * still within the coalescing window is due straight away.
+ */
+static int64_t alarm_next_time(const alarm_t *alarm, int64_t now)
+{
+  int64_t next;
+
+  if (alarm->period == 0)
+    return 0;
+  next = alarm->time + alarm->period;
+  if (next + coalesce <= now)
+    next += ((now - coalesce - next) / alarm->period + 1) * alarm->period;
+  if (alarm->until != 0 && next > alarm->until)
+    return 0;
+  return next;
+}
+
+/*
+ * Copy what a display thread prints of a periodic alarm, so that
+ * the alarm itself can stay in the scheduler.
+ */
+static alarm_t *alarm_copy(const alarm_t *alarm)
+{
+  alarm_t *copy;
+
+  copy = alarm_alloc(alarm->node);
+  copy->delay = alarm->delay;
+  copy->evicts = copy->probe = false;
+  message_copy(copy, alarm);
+  return copy;
+}
+
+/*
+ * Print an expired alarm that has no display thread, or in a
+ * benchmark record how late it was.
+ */
+static void alarm_print(const alarm_t *alarm, int64_t now)
+{
+  char delay[32];
+
+  if (bench_lateness != NULL)
+    bench_lateness[atomic_fetch_add_explicit(&bench_expired, 1, memory_order_relaxed)] =
+        now - alarm->time;
+  else
+  {
+    format_seconds(delay, sizeof(delay), alarm->delay);
+    log_printf("(%s) %s\n", delay, alarm->message);
+  }
+}
+
+/*
+ * The alarm thread's start routine; "arg" is its shard.
+ */
+void *alarm_thread(void *arg)
+{
+  shard_t *shard = arg;
+  alarm_t *alarm, *command;
+  worker_t *worker, *workers;
+  int64_t now, earliest, next, wake = 0;
+  bool timed_out = false, expired, take;
+
+  /*
+   * Loop forever, processing commands. The alarm thread will
+   * be disintegrated when the process exits.
+   */
+  while (1)
+  {
+    /*
+     * Carry out everything that has been submitted, in order.
+     */
+    alarm = submit_take(shard);
+    if (alarm != NULL)
+    {
+      for (; alarm != NULL; alarm = command)
+      {
+        command = alarm->link;
+        alarm_command(shard, alarm);
+      }
+      if (bench_lateness != NULL)
+        shard->bench_carried = clock_real();
+      earliest = sched->next_time(shard->queue);
+      if (wake != 0 && earliest != 0 && earliest < wake)
+        counter_bump(&shard->wake.preempt);
+    }
+    /*
+     * Take every alarm that is due off the scheduler in one go,
+     * so that a burst of alarms with the same deadline costs one
+     * trip around this loop rather than one per alarm. Alarms
+     * whose message type has a display thread are collected per
+     * worker and handed over instead of being printed here. A
+     * periodic alarm that is due again is given its next time
+     * where it is in the scheduler, and a display thread gets a
+     * copy of it. With "-c", nothing is taken until the earliest
+     * alarm has waited out the coalescing window.
+     */
+    now = clock_now();
+    workers = NULL;
+    expired = false;
+    take = coalesce == 0 || (earliest = sched->next_time(shard->queue)) == 0 ||
+           earliest + coalesce <= now;
+    log_hold();
+    while (take && (alarm = sched->due(shard->queue, now)) != NULL)
+    {
+      worker = atomic_load_explicit(&alarm->mtype->worker, memory_order_acquire);
+      counter_bump(&shard->expired);
+      stats_record(lateness, now - alarm->time);
+      expired = true;
+      next = alarm_next_time(alarm, now);
+      if (next == 0)
+      {
+        sched->remove(shard->queue, alarm);
+        shard_count_add(shard, -1);
+        wal_delete(shard, alarm->messageNumber);
+        alarm_index_remove(shard, alarm);
+        admit_release(shard, alarm);
+      }
+      if (worker != NULL)
+        worker_collect(shard, worker, &workers, next == 0 ? alarm : alarm_copy(alarm));
+      else
+        alarm_print(alarm, now);
+      if (next != 0)
+      {
+        alarm->delay = alarm->period;
+        alarm->seq = shard->seq++;
+        sched->retime(shard->queue, alarm, next);
+        evict_note(shard, alarm);
+      }
+      else if (worker == NULL)
+        alarm_free(alarm);
+    }
+    if (timed_out)
+      counter_bump(expired ? &shard->wake.timer : &shard->wake.spurious);
+    timed_out = false;
+    log_release();
+    worker_dispatch(shard, workers);
+    admit_flush(shard);
+    /*
+     * Sleep until the backend next needs attention, or until a
+     * command is submitted. The pending alarms stay in the
+     * backend while we wait, so an earlier alarm costs only
+     * another look at the backend.
+     */
+    wake = sched->next_time(shard->queue);
+    if (wake != 0)
+      wake += coalesce;
+    if (wake != 0 && wake <= clock_now())
+      continue;
+#ifdef DEBUG
+    printf("[waiting: %lld(%lld)]\n", (long long)wake,
+           (long long)(wake - clock_now()));
+#endif
+    wal_sync(shard);
+    if (wait_epoll)
+      timed_out = event_wait(shard, wake);
+    else
+      timed_out = cond_wait(shard, wake);
+  }
+}
+
+/*
+ * Command parser.
+ *
+ * A command line is parsed in a single pass, in place, into a
+ * command_t. Keywords are found through a small hash table built
+ * from the "keywords" table, numbers are converted by hand, and
+ * the message of a Type A request is left where it is in the line
+ * as a pointer and a length; it is copied only once, into the
+ * alarm that carries it. Blanks are optional around punctuation,
+ * as they were with the sscanf formats this replaces.
+ *
+ * The grammar is:
+ *
+ *      <seconds> Message(<type>, <number>) <message>
+ *      <seconds> Every(<seconds>) Message(<type>, <number>) <message>
+ *      <seconds> Every(<seconds>, <count>) Message(<type>, <number>) <message>
+ *      <seconds> Every(<seconds>, Until <seconds>) Message(<type>, <number>) <message>
+ *      Create_Thread: MessageType(<type>)
+ *      Cancel: Message(<number>)
+ *      Cancel: MessageType(<type>)
+ *      Cancel: Window(<seconds>, <seconds>)
+ *      Reschedule: MessageType(<type>) [+|-]<seconds>
+ *      Reschedule: Window(<seconds>, <seconds>) [+|-]<seconds>
+ *      Pause_Thread: MessageType(<type>)
+ *      Resume_Thread: MessageType(<type>)
+ *      Stats
+ *
+ * An alarm with Every expires first after <seconds>, then once a
+ * period, for ever, <count> times in all, or until the number of
+ * seconds from now after Until; "period" and "until" hold them,
+ * and a count is turned into the time of the last expiration. A
+ * Window is the alarms due from the first to the second number
+ * of seconds from now. For a Cancel or Reschedule, "scope" is 'N'
+ * for one message number, 'T' for a message type or 'W' for a
+ * window from "from" to "to"; the Reschedule's signed shift is
+ * kept in "delay".
+ */
+typedef struct command_tag
+{
+  char type;
+  char scope;
+  int messageType;
+  int messageNumber;
+  int64_t delay;
+  int64_t period;
+  int64_t until;
+  int64_t from;
+  int64_t to;
+  const char *message;
+  size_t length;
+} command_t;
+
+/*
+ * How a keyword is followed: by nothing, "MessageType(<type>)", a
+ * Cancel's scope, or a Reschedule's scope and shift.
+ */
+#define ARG_NONE 0
+#define ARG_TYPE 1
+#define ARG_SCOPE 2
+#define ARG_SHIFT 3
+
+typedef struct keyword_tag
+{
+  const char *name;
+  char type;
+  int argument;
+} keyword_t;
+
+static const keyword_t keywords[] = {
+    {"Create_Thread", 'B', ARG_TYPE},
+    {"Cancel", 'C', ARG_SCOPE},
+    {"Pause_Thread", 'D', ARG_TYPE},
+    {"Resume_Thread", 'E', ARG_TYPE},
+    {"Reschedule", 'R', ARG_SHIFT},
+    {"Stats", 'S', ARG_NONE},
+};
+
+#define NKEYWORDS (sizeof(keywords) / sizeof(keywords[0]))
+#define KEYWORD_SLOTS 32
+
+/*
+ * Open-addressed table of indexes into "keywords", plus one; 0 is
+ * an empty slot.
+ */
+static unsigned char keyword_slots[KEYWORD_SLOTS];
+
+static unsigned keyword_hash(const char *word, size_t length)
+{
+  return (word[0] * 31u + word[length - 1] * 7u + (unsigned)length) % KEYWORD_SLOTS;
+}
+
+void keyword_init(void)
+{
+  unsigned slot;
+  size_t i;
+
+  for (i = 0; i < NKEYWORDS; i++)
+  {
+    slot = keyword_hash(keywords[i].name, strlen(keywords[i].name));
+    while (keyword_slots[slot] != 0)
+      slot = (slot + 1) % KEYWORD_SLOTS;
+    keyword_slots[slot] = i + 1;
+  }
+}
+
+static const keyword_t *keyword_find(const char *word, size_t length)
+{
+  const keyword_t *keyword;
+  unsigned slot;
+
+  for (slot = keyword_hash(word, length); keyword_slots[slot] != 0;
+       slot = (slot + 1) % KEYWORD_SLOTS)
+  {
+    keyword = &keywords[keyword_slots[slot] - 1];
+    if (strncmp(keyword->name, word, length) == 0 && keyword->name[length] == '\0')
+      return keyword;
+  }
+  return NULL;
+}
+
+static const char *skip_blanks(const char *p)
+{
+  while (*p == ' ' || *p == '\t')
+    p++;
+  return p;
+}
+
+/*
+ * Match literal text, with blanks allowed before it.
+ */
+static const char *parse_literal(const char *p, const char *text)
+{
+  p = skip_blanks(p);
+  while (*text != '\0')
+    if (*p++ != *text++)
+      return NULL;
+  return p;
+}
+
+/*
+ * Parse a decimal int, with blanks and a sign allowed before it.
+ */
+static const char *parse_int(const char *p, int *value)
+{
+  long long result = 0;
+  bool negative = false;
+
+  p = skip_blanks(p);
+  if (*p == '-' || *p == '+')
+    negative = *p++ == '-';
+  if (!isdigit((unsigned char)*p))
+    return NULL;
+  for (; isdigit((unsigned char)*p); p++)
+  {
+    result = result * 10 + (*p - '0');
+    if (result > (long long)INT_MAX + 1)
+      return NULL;
+  }
+  if (negative)
+    result = -result;
+  if (result > INT_MAX)
+    return NULL;
+  *value = (int)result;
+  return p;
+}
+
+/*
+ * Parse what follows "Cancel:" or "Reschedule:": the alarms to act
+ * on and, if "shift", the signed number of seconds to move them.
+ * A Reschedule cannot name a single message number; a Type A
+ * request with the same number does that.
+ */
+static int parse_scope(const char *p, bool shift, command_t *command)
+{
+  const char *q;
+  bool negative;
+
+  if (!shift && (q = parse_literal(p, "Message(")) != NULL)
+  {
+    command->scope = 'N';
+    p = parse_int(q, &command->messageNumber);
+  }
+  else if ((q = parse_literal(p, "MessageType(")) != NULL)
+  {
+    command->scope = 'T';
+    p = parse_int(q, &command->messageType);
+  }
+  else if ((q = parse_literal(p, "Window(")) != NULL)
+  {
+    command->scope = 'W';
+    if ((p = parse_seconds(skip_blanks(q), &command->from)) == NULL ||
+        (p = parse_literal(p, ",")) == NULL ||
+        (p = parse_seconds(skip_blanks(p), &command->to)) == NULL ||
+        command->to < command->from)
+      return 0;
+  }
+  else
+    return 0;
+  if (p == NULL || (p = parse_literal(p, ")")) == NULL)
+    return 0;
+  if (!shift)
+    return 1;
+  p = skip_blanks(p);
+  negative = *p == '-';
+  if (*p == '-' || *p == '+')
+    p++;
+  if (parse_seconds(p, &command->delay) == NULL)
+    return 0;
+  if (negative)
+    command->delay = -command->delay;
+  return 1;
+}
+
+/*
+ * Parse what follows "Every(" in a Type A request. An alarm whose
+ * end leaves room for only one expiration is not made periodic.
+ */
+static const char *parse_every(const char *p, command_t *command)
+{
+  const char *q;
+  int count;
+
+  if ((p = parse_seconds(skip_blanks(p), &command->period)) == NULL ||
+      command->period == 0)
+    return NULL;
+  if ((q = parse_literal(p, ",")) != NULL)
+  {
+    if ((p = parse_literal(q, "Until")) != NULL)
+    {
+      if ((p = parse_seconds(skip_blanks(p), &command->until)) == NULL ||
+          command->until < command->delay)
+        return NULL;
+      if (command->until < command->delay + command->period)
+        command->period = command->until = 0;
+    }
+    else if ((p = parse_int(q, &count)) == NULL || count < 1)
+      return NULL;
+    else if (count == 1)
+      command->period = 0;
+    else if (count - 1 < (INT64_MAX / 2 - command->delay) / command->period)
+      command->until = command->delay + (count - 1) * command->period;
+  }
+  return parse_literal(p, ")");
+}
+
+/*
+ * Parse a command line. Returns 0 if it is not a valid command.
+ */
+int command_parse(const char *line, command_t *command)
+{
+  const keyword_t *keyword;
+  const char *p = line, *end;
+
+  if (isdigit((unsigned char)*p))
+  {
+    command->type = 'A';
+    command->period = command->until = 0;
+    if ((p = parse_seconds(p, &command->delay)) == NULL)
+      return 0;
+    if ((end = parse_literal(p, "Every(")) != NULL &&
+        (p = parse_every(end, command)) == NULL)
+      return 0;
+    if ((p = parse_literal(p, "Message(")) == NULL ||
+        (p = parse_int(p, &command->messageType)) == NULL ||
+        (p = parse_literal(p, ",")) == NULL ||
+        (p = parse_int(p, &command->messageNumber)) == NULL ||
+        (p = parse_literal(p, ")")) == NULL)
+      return 0;
+    p = skip_blanks(p);
+    for (end = p; *end != '\0' && *end != '\n'; end++)
+      ;
+    if (end == p)
+      return 0;
+    command->message = p;
+    command->length = end - p;
+    return 1;
+  }
+  for (end = p; isalpha((unsigned char)*end) || *end == '_'; end++)
+    ;
+  if (end == p || (keyword = keyword_find(p, end - p)) == NULL)
+    return 0;
+  command->type = keyword->type;
+  if (keyword->argument == ARG_NONE)
+    return *skip_blanks(end) == '\0' || *skip_blanks(end) == '\n';
+  if ((p = parse_literal(end, ":")) == NULL)
+    return 0;
+  if (keyword->argument != ARG_TYPE)
+    return parse_scope(p, keyword->argument == ARG_SHIFT, command);
+  if ((p = parse_literal(p, "MessageType(")) == NULL ||
+      (p = parse_int(p, &command->messageType)) == NULL)
+    return 0;
+  return parse_literal(p, ")") != NULL;
+}
+
+/*
+ * Allocate the request shared by every shard's copy of a bulk
+ * command; a window is measured from now.
+ */
+bulk_t *bulk_create(const command_t *command)
+{
+  bulk_t *bulk;
+
+  bulk = malloc(sizeof(bulk_t));
+  if (bulk == NULL)
+    errno_abort("Allocate bulk request");
+  bulk->type = command->type;
+  bulk->scope = command->scope;
+  bulk->messageType = command->messageType;
+  bulk->issued = clock_now();
+  bulk->from = bulk->issued + command->from;
+  bulk->to = bulk->issued + command->to;
+  bulk->delta = command->delay;
+  atomic_init(&bulk->shards, shard_count);
+  atomic_init(&bulk->matched, 0);
+  return bulk;
+}
+
+/*
+ * Allocate the alarm that carries a parsed command to the alarm
+ * thread. A Type A request's message is copied here, truncated to
+ * fit, and its expiration time is fixed from the current time.
+ */
+alarm_t *command_alarm(const command_t *command)
+{
+  alarm_t *alarm;
+  int node = shards[0]->node;
+
+  if (command->type == 'A')
+    node = shard_for(command->messageNumber)->node;
+  alarm = alarm_alloc(node);
+  alarm->type = command->type;
+  alarm->messageType = command->messageType;
+  alarm->messageNumber = command->messageNumber;
+  alarm->bulk = NULL;
+  alarm->evicts = alarm->probe = false;
+  if (command->type == 'R' || (command->type == 'C' && command->scope != 'N'))
+    alarm->bulk = bulk_create(command);
+  if (command->type == 'A')
+  {
+    message_set(alarm, command->message, command->length);
+    alarm->delay = command->delay;
+    alarm->time = clock_now() + command->delay;
+    alarm->period = command->period;
+    alarm->until = command->until == 0 ? 0 : alarm->time - command->delay + command->until;
+    type_hold(alarm);
+  }
+  return alarm;
+}
+
+/*
+ * The signal thread's start routine. SIGUSR1 is blocked in every
+ * thread and taken here with sigwait, so that a Stats command can
+ * be submitted without doing anything in a signal handler. With
+ * "-S", a Stats command is also submitted every "stats_period"
+ * nanoseconds.
+ */
+int64_t stats_period = 0;
+
+void *signal_thread(void *arg)
+{
+  sigset_t *signals = arg;
+  struct timespec timeout;
+  command_t command = {.type = 'S'};
+  int signal, status;
+
+  timeout.tv_sec = stats_period / NSEC_PER_SEC;
+  timeout.tv_nsec = stats_period % NSEC_PER_SEC;
+  while (1)
+  {
+    /*
+     * sigtimedwait() sets errno, EAGAIN once the period is up;
+     * sigwait() returns its error number instead.
+     */
+    if (stats_period != 0)
+    {
+      if (sigtimedwait(signals, NULL, &timeout) < 0 && errno != EAGAIN)
+        continue;
+    }
+    else
+    {
+      status = sigwait(signals, &signal);
+      if (status != 0)
+        continue;
+    }
+    alarm_submit(command_alarm(&command));
+  }
+}
+
+/*
+ * Print the wakeup and output counters, for "-v".
+ */
+void wake_stats_print(void)
+{
+  unsigned long timer = 0, submit = 0, preempt = 0, spurious = 0;
+  int i;
+
+  for (i = 0; i < shard_count; i++)
+  {
+    timer += atomic_load(&shards[i]->wake.timer);
+    submit += atomic_load(&shards[i]->wake.submit);
+    preempt += atomic_load(&shards[i]->wake.preempt);
+    spurious += atomic_load(&shards[i]->wake.spurious);
+  }
+  fprintf(stderr, "Wakeups: %lu timer, %lu submit (%lu preempting), %lu spurious\n",
+          timer, submit, preempt, spurious);
+  fprintf(stderr, "Output: %lu lines in %lu writes\n",
+          atomic_load(&log_lines), atomic_load(&log_writes));
+  if (log_drop)
+    fprintf(stderr, "Output: %lu lines dropped\n", atomic_load(&log_dropped));
+}
+
+/*
+ * Parse one command line and add the command to "batch". Returns
+ * false if the line is not a valid command.
+ */
+bool command_line(const char *line, submit_batch_t *batch)
+{
+  command_t command;
+
+  if (!command_parse(line, &command))
+    return false;
+  batch_admit(batch, command_alarm(&command));
+  return true;
+}
+
+/*
+ * Binary frames.
+ *
+ * A program that generates commands may send them as frames
+ * instead of lines, from a file, on standard input ("-f -") or to
+ * the server, mixed with lines in the same stream. A frame is a
+ * frame_t in the host's byte order, followed by "size" bytes of
+ * message and no newline; its first byte is FRAME_MAGIC, which no
+ * command line starts with. Its fields mean what they do in a
+ * command_t, in nanoseconds: "delay" is how long a Type A request
+ * waits, or with FRAME_DEADLINE the CLOCK_REALTIME time at which
+ * it expires, and the shift of a Reschedule; "from" and "to" are a
+ * Window, or for a Type A request the period of a periodic alarm
+ * and how long from now its last expiration may be (0 for no
+ * end). Nothing is parsed: the fields are checked and stored,
+ * and the message is copied once, straight from the read buffer
+ * into the alarm.
+ */
+#define FRAME_MAGIC 0xA5
+#define FRAME_DEADLINE 1
+#define FRAME_MESSAGE 1024
+#define FRAME_DELAY_MAX (1000000000LL * NSEC_PER_SEC)
+
+typedef struct frame_tag
+{
+  uint8_t magic;
+  uint8_t type;
+  uint8_t scope;
+  uint8_t flags;
+  uint32_t size;
+  int32_t messageType;
+  int32_t messageNumber;
+  int64_t delay;
+  int64_t from;
+  int64_t to;
+} frame_t;
+
+/*
+ * Fill in "command" from a frame whose message is at "message".
+ * Returns false if the frame is not a valid command.
+ */
+static bool frame_decode(const frame_t *frame, const char *message, command_t *command)
+{
+  command->type = frame->type;
+  command->scope = frame->scope;
+  command->messageType = frame->messageType;
+  command->messageNumber = frame->messageNumber;
+  command->delay = frame->delay;
+  command->period = frame->from;
+  command->until = frame->to;
+  command->from = frame->from;
+  command->to = frame->to;
+  command->message = message;
+  command->length = frame->size;
+  switch (frame->type)
+  {
+  case 'A':
+    if (frame->flags & FRAME_DEADLINE)
+    {
+      command->delay -= clock_offset() + clock_now();
+      if (command->delay < 0)
+        command->delay = 0;
+    }
+    return frame->size > 0 && command->delay >= 0 && command->delay < FRAME_DELAY_MAX &&
+           frame->from >= 0 && frame->from < FRAME_DELAY_MAX &&
+           (frame->to == 0 || (frame->from != 0 && frame->to >= command->delay &&
+                               frame->to < FRAME_DELAY_MAX));
+  case 'B':
+  case 'D':
+  case 'E':
+  case 'S':
+    return true;
+  case 'C':
+    if (frame->scope == 'N')
+      return true;
+    /* Fall through */
+  case 'R':
+    if (frame->type == 'R' &&
+        (frame->delay <= -FRAME_DELAY_MAX || frame->delay >= FRAME_DELAY_MAX))
+      return false;
+    return frame->scope == 'T' ||
+           (frame->scope == 'W' && frame->from >= 0 && frame->from <= frame->to &&
+            frame->to < FRAME_DELAY_MAX);
+  }
+  return false;
+}
+
+/*
+ * Take the frame at the start of the "available" bytes at "p",
+ * and add its command to "batch" if it is valid, or set "*bad" if
+ * it is not. Returns the length of the frame, 0 if it has not all
+ * arrived yet, or -1 if its size is impossible, so that where it
+ * ends is not known.
+ */
+static ssize_t frame_take(const char *p, size_t available, submit_batch_t *batch, bool *bad)
+{
+  frame_t frame;
+  command_t command;
+
+  if (available < sizeof(frame_t))
+    return 0;
+  memcpy(&frame, p, sizeof(frame_t)); /* frames need not be aligned */
+  if (frame.size > FRAME_MESSAGE)
+    return -1;
+  if (available < sizeof(frame_t) + frame.size)
+    return 0;
+  *bad = !frame_decode(&frame, p + sizeof(frame_t), &command);
+  if (!*bad)
+    batch_admit(batch, command_alarm(&command));
+  return sizeof(frame_t) + frame.size;
+}
+
+/*
+ * Streaming mode: read commands from "fd" STREAM_BLOCK bytes at a
+ * time, parse every complete line in the block in place, and
+ * submit the resulting commands STREAM_BATCH at a time, a chain
+ * per shard, instead of one fgets(), prompt and submission per
+ * line. Binary frames are taken in the same pass. Whatever is
+ * pending is also submitted before each read, so that a slow pipe
+ * does not hold commands back. A line too long for the buffer is a
+ * bad command, and so is a frame that is cut short by the end of
+ * the input; after a frame whose size is impossible, the input is
+ * skipped up to the next newline.
+ */
+#define STREAM_BLOCK (1 << 20)
+#define STREAM_BATCH 1024
+
+void stream_commands(int fd)
+{
+  char *buffer, *line, *end, *limit;
+  submit_batch_t *batch;
+  size_t kept = 0;
+  ssize_t count, size;
+  int batched = 0;
+  bool eof = false, overlong = false, bad;
+
+  buffer = malloc(STREAM_BLOCK + 1);
+  if (buffer == NULL)
+    errno_abort("Allocate stream buffer");
+  batch = batch_create();
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  while (!eof)
+  {
+    batch_submit(batch);
+    batched = 0;
+    count = read(fd, buffer + kept, STREAM_BLOCK - kept);
+    if (count < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      errno_abort("Read commands");
+    }
+    eof = count == 0;
+    limit = buffer + kept + count;
+    if (eof && limit > buffer)
+      *limit++ = '\n';
+    for (line = buffer; line < limit; line = end + 1)
+    {
+      if ((unsigned char)*line == FRAME_MAGIC && !overlong)
+      {
+        if ((size = frame_take(line, limit - line, batch, &bad)) == 0)
+          break;
+        if (size < 0)
+          overlong = true;
+        else
+        {
+          end = line + size - 1;
+          if (bad)
+            fprintf(stderr, "Bad command\n");
+          else if (++batched == STREAM_BATCH)
+          {
+            batch_submit(batch);
+            batched = 0;
+          }
+          continue;
+        }
+      }
+      if ((end = memchr(line, '\n', limit - line)) == NULL)
+        break;
+      *end = '\0';
+      if (overlong)
+      {
+        overlong = false;
+        fprintf(stderr, "Bad command\n");
+        continue;
+      }
+      if (end == line)
+        continue;
+      if (!command_line(line, batch))
+      {
+        fprintf(stderr, "Bad command\n");
+        continue;
+      }
+      if (++batched == STREAM_BATCH)
+      {
+        batch_submit(batch);
+        batched = 0;
+      }
+    }
+    if (eof && line < limit)
+      fprintf(stderr, "Bad command\n");
+    kept = limit - line;
+    if (kept == STREAM_BLOCK)
+    {
+      overlong = true;
+      kept = 0;
+    }
+    memmove(buffer, line, kept);
+  }
+  batch_submit(batch);
+  free(batch);
+  free(buffer);
+}
+
+/*
+ * Command server.
+ *
+ * With "-l address", a server thread accepts connections on a TCP
+ * port ("port" or "host:port") or a Unix socket (any address with
+ * a '/' in it) and reads commands from every client at once, in
+ * the same grammar as the prompt or as binary frames. The thread
+ * waits for all of its sockets in one epoll set; every socket is
+ * non-blocking, and each connection has a read buffer of its own
+ * that holds a partial line until the rest of it arrives. A client
+ * may send any number of commands without waiting: whatever
+ * complete lines one read returns are parsed in place, and the
+ * commands parsed during one pass over the ready sockets are
+ * submitted together, a chain per shard. A client is told of a bad
+ * command, or of a line longer than CONN_BUFFER, with a "Bad
+ * command" reply; every other output goes where a command from the
+ * prompt would send it.
+ */
+#define CONN_BUFFER 4096
+#define SERVER_EVENTS 64
+
+typedef struct conn_tag
+{
+  int fd;
+  size_t kept;
+  bool overlong;
+  char buffer[CONN_BUFFER + 1];
+} conn_t;
+
+static void set_nonblocking(int fd)
+{
+  int flags;
+
+  flags = fcntl(fd, F_GETFL);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0)
+    errno_abort("Set socket non-blocking");
+}
+
+/*
+ * Create the listening socket for an address given to "-l".
+ */
+int server_listen(const char *address)
+{
+  struct addrinfo hints, *info;
+  struct sockaddr_un local;
+  struct stat sb;
+  const char *port;
+  char host[256];
+  int fd, status, on = 1;
+
+  if (strchr(address, '/') != NULL)
+  {
+    if (strlen(address) >= sizeof(local.sun_path))
+    {
+      fprintf(stderr, "Socket path \"%s\" is too long\n", address);
+      exit(1);
+    }
+    memset(&local, 0, sizeof(local));
+    local.sun_family = AF_UNIX;
+    strcpy(local.sun_path, address);
+    /*
+     * A socket left behind by an earlier run would make bind()
+     * fail; anything else at the path is left alone.
+     */
+    if (stat(address, &sb) == 0 && S_ISSOCK(sb.st_mode))
+      unlink(address);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+      errno_abort("Create socket");
+    if (bind(fd, (struct sockaddr *)&local, sizeof(local)) != 0)
+      errno_abort("Bind socket");
+  }
+  else
+  {
+    port = strrchr(address, ':');
+    if (port == NULL)
+    {
+      host[0] = '\0';
+      port = address;
+    }
+    else
+    {
+      snprintf(host, sizeof(host), "%.*s", (int)(port - address), address);
+      port++;
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    status = getaddrinfo(host[0] != '\0' ? host : NULL, port, &hints, &info);
+    if (status != 0)
+    {
+      fprintf(stderr, "Bad address \"%s\": %s\n", address, gai_strerror(status));
+      exit(1);
+    }
+    fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+    if (fd < 0)
+      errno_abort("Create socket");
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0)
+      errno_abort("Set socket option");
+    if (bind(fd, info->ai_addr, info->ai_addrlen) != 0)
+      errno_abort("Bind socket");
+    freeaddrinfo(info);
+  }
+  if (listen(fd, SOMAXCONN) != 0)
+    errno_abort("Listen on socket");
+  set_nonblocking(fd);
+  return fd;
+}
 
+#ifdef __linux__
 /*
- * The "alarm" structure now contains the time_t (time since the
- * Epoch, in seconds) for each alarm, so that they can be
- * sorted. Storing the requested number of seconds would not be
- * enough, since the "alarm thread" cannot tell how long it has
- * been on the list.
+ * Tell a client that one of its lines was not a command. The reply
+ * is dropped if the client is not reading its replies.
  */
-typedef struct alarm_tag
+static void conn_reply(conn_t *conn, const char *text)
 {
-  struct alarm_tag *link;
-  char type;
-  int seconds;
-  int messageType;
-  int messageNumber;
-  time_t time; /* seconds from EPOCH */
-  char message[128];
-} alarm_t;
+  ssize_t sent;
 
-pthread_mutex_t alarm_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t alarm_cond = PTHREAD_COND_INITIALIZER;
-alarm_t *alarm_list = NULL;
-time_t current_alarm = 0;
+  sent = send(conn->fd, text, strlen(text), MSG_DONTWAIT | MSG_NOSIGNAL);
+  (void)sent;
+}
 
 /*
- * Insert alarm entry on list, in order.
+ * Read everything a client has sent, and add its complete lines
+ * and frames to "batch". Returns false once the client has closed
+ * its end, or the connection has failed; a last line without a
+ * newline is then taken as complete.
  */
-void alarm_insert(alarm_t *alarm)
+static bool conn_read(conn_t *conn, submit_batch_t *batch)
 {
-  int status;
-  alarm_t **last, *next;
+  char *line, *end, *limit;
+  ssize_t count, size;
+  bool eof = false, bad;
 
-  /*
-   * LOCKING PROTOCOL:
-   *
-   * This routine requires that the caller have locked the
-   * alarm_mutex!
-   */
-  last = &alarm_list;
-  next = *last;
-  while (next != NULL)
-  {
-    if (next->type == 'A' && next->messageNumber == alarm->messageNumber){
-      printf("Type A Replacement Alarm Request With Message Number %d Inserted Into Alarm List at %lld: %c\n", alarm->messageNumber, (long long) time(NULL), alarm->type);
-      alarm->link = next;
-      next = alarm;
-      break;
+  while (!eof)
+  {
+    count = read(conn->fd, conn->buffer + conn->kept, CONN_BUFFER - conn->kept);
+    if (count < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return true;
+      return false;
     }
-    if (next->time >= alarm->time)
+    eof = count == 0;
+    limit = conn->buffer + conn->kept + count;
+    if (eof && limit > conn->buffer && !conn->overlong)
+      *limit++ = '\n';
+    for (line = conn->buffer; line < limit; line = end + 1)
     {
-      alarm->link = next;
-      *last = alarm;
-      printf("Type A Alarm Request With Message Number %d Inserted Into Alarm List at %lld: %c\n", alarm->messageNumber, (long long) time(NULL), alarm->type);
-      break;
+      if ((unsigned char)*line == FRAME_MAGIC && !conn->overlong)
+      {
+        if ((size = frame_take(line, limit - line, batch, &bad)) == 0)
+          break;
+        if (size < 0)
+          conn->overlong = true;
+        else
+        {
+          end = line + size - 1;
+          if (bad)
+            conn_reply(conn, "Bad command\n");
+          continue;
+        }
+      }
+      if ((end = memchr(line, '\n', limit - line)) == NULL)
+        break;
+      *end = '\0';
+      if (end > line && end[-1] == '\r')
+        end[-1] = '\0';
+      if (conn->overlong)
+      {
+        conn->overlong = false;
+        conn_reply(conn, "Bad command\n");
+        continue;
+      }
+      if (*line == '\0')
+        continue;
+      if (!command_line(line, batch))
+        conn_reply(conn, "Bad command\n");
     }
-    last = &next->link;
-    next = next->link;
+    conn->kept = limit - line;
+    if (conn->kept == CONN_BUFFER)
+    {
+      conn->overlong = true;
+      conn->kept = 0;
+    }
+    memmove(conn->buffer, line, conn->kept);
   }
-  /*
-   * If we reached the end of the list, insert the new alarm
-   * there.  ("next" is NULL, and "last" points to the link
-   * field of the last item, or to the list header.)
-   */
-  if (next == NULL)
+  return false;
+}
+
+/*
+ * The server thread's start routine; "arg" is the listening socket.
+ */
+void *server_thread(void *arg)
+{
+  struct epoll_event event, events[SERVER_EVENTS];
+  submit_batch_t *batch;
+  conn_t *conn;
+  int listen_fd = (int)(intptr_t)arg, epoll_fd, fd, count, i;
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0)
+    errno_abort("Create epoll set");
+  event.events = EPOLLIN;
+  event.data.ptr = NULL;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) != 0)
+    errno_abort("Add to epoll set");
+  batch = batch_create();
+  while (1)
   {
-    *last = alarm;
-    alarm->link = NULL;
+    count = epoll_wait(epoll_fd, events, SERVER_EVENTS, -1);
+    if (count < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      errno_abort("Wait for events");
+    }
+    for (i = 0; i < count; i++)
+    {
+      conn = events[i].data.ptr;
+      if (conn != NULL)
+      {
+        if (!conn_read(conn, batch))
+        {
+          close(conn->fd);
+          free(conn);
+        }
+        continue;
+      }
+      while ((fd = accept(listen_fd, NULL, NULL)) >= 0)
+      {
+        set_nonblocking(fd);
+        conn = malloc(sizeof(conn_t));
+        if (conn == NULL)
+          errno_abort("Allocate connection");
+        conn->fd = fd;
+        conn->kept = 0;
+        conn->overlong = false;
+        event.events = EPOLLIN;
+        event.data.ptr = conn;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0)
+          errno_abort("Add to epoll set");
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+          errno != ECONNABORTED)
+        fprintf(stderr, "Accept connection: %s\n", strerror(errno));
+    }
+    batch_submit(batch);
   }
-#ifdef DEBUG
-  printf("[list: ");
-  for (next = alarm_list; next != NULL; next = next->link)
-    printf("%d(%d)[\"%s\"] ", next->time,
-           next->time - time(NULL), next->message);
-  printf("]\n");
+}
+#else
+void *server_thread(void *arg)
+{
+  fprintf(stderr, "-l needs Linux\n");
+  exit(1);
+}
 #endif
-  /*
-   * Wake the alarm thread if it is not busy (that is, if
-   * current_alarm is 0, signifying that it's waiting for
-   * work), or if the new alarm comes before the one on
-   * which the alarm thread is waiting.
-   */
-  if (current_alarm == 0 || alarm->time < current_alarm)
+
+/*
+ * Wait until every alarm thread has carried out every command, and
+ * if "alarms", has no alarm left, once the input has run out.
+ */
+void wait_idle(bool alarms)
+{
+  shard_t *shard;
+  int64_t locked;
+  int status, i;
+
+  for (i = 0; i < shard_count; i++)
   {
-    current_alarm = alarm->time;
-    status = pthread_cond_signal(&alarm_cond);
+    shard = shards[i];
+    locked = mutex_lock(&shard->mutex, &alarm_lock_stats);
+    shard->input_done = true;
+    shard->wait_alarms = alarms;
+    if (wait_epoll)
+      event_notify(shard);
+    status = pthread_cond_signal(&shard->cond);
     if (status != 0)
       err_abort(status, "Signal cond");
+    while (!shard->idle)
+    {
+      stats_record(lock_hold, stats_clock() - locked);
+      status = pthread_cond_wait(&shard->idle_cond, &shard->mutex);
+      if (status != 0)
+        err_abort(status, "Wait on cond");
+      locked = stats_clock();
+    }
+    mutex_unlock(&shard->mutex, locked);
   }
 }
 
 /*
- * The alarm thread's start routine.
+ * Benchmark mode.
+ *
+ * "-B workload" generates "-n count" commands in memory, submits
+ * them to the alarm thread STREAM_BATCH at a time, as streaming
+ * mode does, and waits for every alarm to expire. Output is
+ * suppressed; instead the alarm thread records how late each
+ * alarm expired, and the run reports how fast the commands were
+ * carried out, the lateness percentiles, and how often the
+ * program's mutexes and the submit stack were contended. Unless
+ * "-b" names a backend, each backend is run in a process of its
+ * own, so that the runs do not share any state. With "-t virtual",
+ * nothing waits for a deadline, so the run also reports how long
+ * the scheduler took to expire every alarm.
+ *
+ * The workloads are:
+ *
+ *      uniform         deadlines spread evenly over BENCH_SPAN
+ *      bursty          bursts of BENCH_BURST alarms, each burst
+ *                      within a millisecond of a random deadline
+ *      deadline        every alarm due at the same time
+ *      replace         messageNumbers drawn from count/100 values,
+ *                      so that most requests replace an alarm
+ *      mixed           uniform alarms over count/4 messageNumbers,
+ *                      with one request in four a Cancel
+ */
+#define BENCH_SPAN (2 * NSEC_PER_SEC)
+#define BENCH_BURST 1000
+
+const char *const bench_workloads[] = {
+    "uniform", "bursty", "deadline", "replace", "mixed", NULL};
+
+uint64_t bench_state = 88172645463325252ull;
+
+/*
+ * xorshift64: the same command stream on every run.
  */
-void *alarm_thread(void *arg)
+static uint64_t bench_random(void)
 {
-  alarm_t *alarm;
-  struct timespec cond_time;
-  time_t now;
-  int status, expired;
+  bench_state ^= bench_state << 13;
+  bench_state ^= bench_state >> 7;
+  bench_state ^= bench_state << 17;
+  return bench_state;
+}
 
-  /*
-   * Loop forever, processing commands. The alarm thread will
-   * be disintegrated when the process exits. Lock the mutex
-   * at the start -- it will be unlocked during condition
-   * waits, so the main thread can insert alarms.
-   */
-  status = pthread_mutex_lock(&alarm_mutex);
-  if (status != 0)
-    err_abort(status, "Lock mutex");
-  while (1)
+static int bench_compare(const void *a, const void *b)
+{
+  int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+/*
+ * Build a command of the given workload, in place of a parsed
+ * line.
+ */
+static void bench_command(const char *workload, int i, int count,
+                          command_t *command)
+{
+  static int64_t burst;
+
+  command->type = 'A';
+  command->scope = 'N';
+  command->period = command->until = 0;
+  command->messageType = i % 8;
+  command->messageNumber = i;
+  command->message = "benchmark";
+  command->length = 9;
+  if (strcmp(workload, "uniform") == 0)
+    command->delay = bench_random() % BENCH_SPAN;
+  else if (strcmp(workload, "bursty") == 0)
   {
-    /*
-     * If the alarm list is empty, wait until an alarm is
-     * added. Setting current_alarm to 0 informs the insert
-     * routine that the thread is not busy.
-     */
-    current_alarm = 0;
-    while (alarm_list == NULL)
-    {
-      status = pthread_cond_wait(&alarm_cond, &alarm_mutex);
-      if (status != 0)
-        err_abort(status, "Wait on cond");
-    }
-    alarm = alarm_list;
-    alarm_list = alarm->link;
-    now = time(NULL);
-    expired = 0;
-    if (alarm->time > now)
+    if (i % BENCH_BURST == 0)
+      burst = bench_random() % BENCH_SPAN;
+    command->delay = burst + bench_random() % (NSEC_PER_SEC / 1000);
+  }
+  else if (strcmp(workload, "deadline") == 0)
+    command->delay = BENCH_SPAN / 2;
+  else if (strcmp(workload, "replace") == 0)
+  {
+    command->messageNumber = bench_random() % (count / 100 + 1);
+    command->delay = bench_random() % BENCH_SPAN;
+  }
+  else
+  {
+    command->messageNumber = bench_random() % (count / 4 + 1);
+    command->delay = bench_random() % BENCH_SPAN;
+    if (bench_random() % 4 == 0)
+      command->type = 'C';
+  }
+}
+
+static int64_t bench_percentile(int expired, int per_mille)
+{
+  if (expired == 0)
+    return 0;
+  return bench_lateness[(int64_t)(expired - 1) * per_mille / 1000];
+}
+
+void bench_run(const char *workload, int count)
+{
+  submit_batch_t *batch;
+  command_t command;
+  int64_t start, finished, carried = 0;
+  int i, batched = 0, expired;
+  unsigned long taken;
+
+  bench_lateness = malloc(count * sizeof(int64_t));
+  if (bench_lateness == NULL)
+    errno_abort("Allocate lateness samples");
+  batch = batch_create();
+  start = clock_real();
+  for (i = 0; i < count; i++)
+  {
+    bench_command(workload, i, count, &command);
+    batch_add(batch, command_alarm(&command));
+    if (++batched == STREAM_BATCH || i == count - 1)
     {
-#ifdef DEBUG
-      printf("[waiting: %d(%d)\"%s\"]\n", alarm->time,
-             alarm->time - time(NULL), alarm->message);
-#endif
-      cond_time.tv_sec = alarm->time;
-      cond_time.tv_nsec = 0;
-      current_alarm = alarm->time;
-      while (current_alarm == alarm->time)
-      {
-        status = pthread_cond_timedwait(
-            &alarm_cond, &alarm_mutex, &cond_time);
-        if (status == ETIMEDOUT)
-        {
-          expired = 1;
-          break;
-        }
-        if (status != 0)
-          err_abort(status, "Cond timedwait");
-      }
-      if (!expired)
-        alarm_insert(alarm);
+      batch_submit(batch);
+      batched = 0;
     }
-    else
-      expired = 1;
-    if (expired)
-    {
-      printf("(%d) %s\n", alarm->seconds, alarm->message);
-      free(alarm);
-    }
-  }
-}
-
-char typeFinder(char line[])
-{
-  if (isdigit(line[0]))
-  {
-    // isValidTypeA(line);
-    return 'A';
-  }
-  else if (
-      line[0] == 'C' &&
-      line[1] == 'r' &&
-      line[2] == 'e' &&
-      line[3] == 'a' &&
-      line[4] == 't' &&
-      line[5] == 'e' &&
-      line[6] == '_' &&
-      line[7] == 'T' &&
-      line[8] == 'h' &&
-      line[9] == 'r' &&
-      line[10] == 'e' &&
-      line[11] == 'a' &&
-      line[12] == 'd')
-  {
-    return 'B';
-  }
-  else if (
-      line[0] == 'C' &&
-      line[1] == 'a' &&
-      line[2] == 'n' &&
-      line[3] == 'c' &&
-      line[4] == 'e' &&
-      line[5] == 'l')
-  {
-    return 'C';
-  }
-  else if (
-      line[0] == 'P' &&
-      line[1] == 'a' &&
-      line[2] == 'u' &&
-      line[3] == 's' &&
-      line[4] == 'e' &&
-      line[5] == '_' &&
-      line[6] == 'T' &&
-      line[7] == 'h' &&
-      line[8] == 'r' &&
-      line[9] == 'e' &&
-      line[10] == 'a' &&
-      line[11] == 'd')
-  {
-    return 'D';
-  }
-  else if (
-      line[0] == 'R' &&
-      line[1] == 'e' &&
-      line[2] == 's' &&
-      line[3] == 'u' &&
-      line[4] == 'm' &&
-      line[5] == 'e' &&
-      line[6] == '_' &&
-      line[7] == 'T' &&
-      line[8] == 'h' &&
-      line[9] == 'r' &&
-      line[10] == 'e' &&
-      line[11] == 'a' &&
-      line[12] == 'd')
-  {
-    return 'E';
-  }
-  return 'F';
+  }
+  wait_idle(true);
+  finished = clock_real();
+  free(batch);
+  /*
+   * The commands have all been carried out when the last shard to
+   * finish them did.
+   */
+  for (i = 0; i < shard_count; i++)
+    if (shards[i]->bench_carried > carried)
+      carried = shards[i]->bench_carried;
+  expired = atomic_load(&bench_expired);
+  qsort(bench_lateness, expired, sizeof(int64_t), bench_compare);
+  printf("%s %s: %d commands in %.3f s (%.0f/s) on %d shards, %d expired\n",
+         sched->name, workload, count, (carried - start) / 1e9,
+         count / ((carried - start) / 1e9), shard_count, expired);
+  printf("  lateness: p50 %.3f ms, p99 %.3f ms, p999 %.3f ms, max %.3f ms\n",
+         bench_percentile(expired, 500) / 1e6, bench_percentile(expired, 990) / 1e6,
+         bench_percentile(expired, 999) / 1e6, bench_percentile(expired, 1000) / 1e6);
+  if (clock_source->skip != NULL)
+    printf("  %s clock: every alarm expired %.3f s after the start (%.0f/s)\n",
+           clock_source->name, (finished - start) / 1e9, expired / ((finished - start) / 1e9));
+  taken = atomic_load(&alarm_lock_stats.taken);
+  printf("  shard mutexes: %lu of %lu contended; pool locks: %lu of %lu contended; %lu submit retries\n",
+         atomic_load(&alarm_lock_stats.contended), taken,
+         atomic_load(&pool_lock_stats.contended), atomic_load(&pool_lock_stats.taken),
+         atomic_load(&submit_retries));
 }
 
 int main(int argc, char *argv[])
 {
   int status;
-  char line[128];
-  alarm_t *alarm;
-  pthread_t thread;
+  char line[256];
+  command_t command;
+  alarm_t *request;
+  pthread_condattr_t cond_attr;
+  pthread_t thread, server;
+  int option, fd = -1, listen_fd = -1, i, count = 100000;
+  const char *workload = NULL, *dir = NULL;
+  bool backend = false;
+  pid_t child;
+  static sigset_t signals;
 
-  status = pthread_create(
-      &thread, NULL, alarm_thread, NULL);
-  if (status != 0)
-    err_abort(status, "Create alarm thread");
-  while (1)
+  clock_init();
+  while ((option = getopt(argc, argv, "a:b:B:c:d:f:j:l:m:M:n:o:p:S:t:vw:")) != -1)
   {
-    printf("Alarm> ");
-    if (fgets(line, sizeof(line), stdin) == NULL)
-      exit(0);
-    if (strlen(line) <= 1)
-      continue;
-
-    int message_type;
-    alarm = (alarm_t *)malloc(sizeof(alarm_t));
- 
-    switch (typeFinder(line))
+    switch (option)
     {
-    case 'A':
-      
-      if (alarm == NULL)
-        errno_abort("Allocate alarm");
-      else if (sscanf(line, "%d Message(%d, %d) %128[^\n]", &alarm->seconds, &alarm->messageType, &alarm->messageNumber, alarm->message) < 4)
+    case 'a':
+      if (strcmp(optarg, "block") == 0)
+        admit_policy = ADMIT_BLOCK;
+      else if (strcmp(optarg, "reject") == 0)
+        admit_policy = ADMIT_REJECT;
+      else if (strcmp(optarg, "evict") == 0)
+        admit_policy = ADMIT_EVICT;
+      else
       {
-        fprintf(stderr, "Bad command\n");
-        free(alarm);
+        fprintf(stderr, "Unknown admission policy \"%s\"\n", optarg);
+        exit(1);
       }
-      else
+      break;
+    case 'b':
+      for (i = 0; sched_backends[i] != NULL; i++)
+        if (strcmp(optarg, sched_backends[i]->name) == 0)
+          break;
+      if (sched_backends[i] == NULL)
       {
-        alarm->type = 'A';
-        status = pthread_mutex_lock(&alarm_mutex);
-        if (status != 0)
-          err_abort(status, "Lock mutex");
-        alarm->time = time(NULL) + alarm->seconds;
-        alarm_insert(alarm);
-        status = pthread_mutex_unlock(&alarm_mutex);
-        if (status != 0)
-          err_abort(status, "Unlock mutex");
+        fprintf(stderr, "Unknown scheduler backend \"%s\"\n", optarg);
+        exit(1);
       }
+      sched_choose(sched_backends[i]);
+      backend = true;
       break;
     case 'B':
-      if (sscanf(line, "Create_Thread: MessageType(%d)", &alarm->messageType) < 1)
-      {
-        alarm->type = 'B';
-        alarm_t **last, *next;
-        bool shouldProceed = true;
-
-        last = &alarm_list;
-        next = *last;
-        while(next != NULL){
-          if ( next->type == 'A' && next->messageType != alarm->messageType){
-            printf("Type B Alarm Request Error: No Alarm Request With Message Type %d!", alarm->messageType);
-            shouldProceed = false;
-            break;
-          }
-        }
-        last = &alarm_list;
-        next = *last;
-        while(next != NULL){
-          if ( next->type == 'B' && next->messageType == alarm->messageType){
-            printf("Error: More Than One Type B Alarm Request With Message Type %d!", alarm->messageType);
-            shouldProceed = false;
-            break;
-          }
-        }
-        if (shouldProceed){
-          status = pthread_mutex_lock(&alarm_mutex);
-          if (status != 0)
-            err_abort(status, "Lock mutex");
-          alarm->time = time(NULL) + alarm->seconds;
-          alarm_insert(alarm);
-          status = pthread_mutex_unlock(&alarm_mutex);
-          if (status != 0)
-            err_abort(status, "Unlock mutex");
-        }
-        else{
-          free(alarm);
-        }
+      for (i = 0; bench_workloads[i] != NULL; i++)
+        if (strcmp(optarg, bench_workloads[i]) == 0)
+          break;
+      if (bench_workloads[i] == NULL)
+      {
+        fprintf(stderr, "Unknown benchmark workload \"%s\"\n", optarg);
+        exit(1);
       }
+      workload = bench_workloads[i];
       break;
-    case 'C':
-      if (sscanf(line, "Cancel: Message(%d)", &alarm->messageNumber) < 1)
-      {
-        alarm->type = 'C';
-        alarm_t **last, *next;
-        bool shouldProceed = true;
-
-        last = &alarm_list;
-        next = *last;
-        while(next != NULL){
-          if ( next->type == 'A' && next->messageNumber != alarm->messageNumber){
-            printf("Error: No Alarm Request With Message Number %d to Cancel!", alarm->messageNumber);
-            shouldProceed = false;
-            break;
-          }
-        }
-        last = &alarm_list;
-        next = *last;
-        while(next != NULL){
-          if ( next->type == 'B' && next->messageNumber == alarm->messageNumber){
-            printf("Error: More Than One Request to Cancel Alarm Request With Message Number %d!", alarm->messageNumber);
-            shouldProceed = false;
-            break;
-          }
-        }
-        if (shouldProceed){
-          status = pthread_mutex_lock(&alarm_mutex);
-          if (status != 0)
-            err_abort(status, "Lock mutex");
-          alarm->time = time(NULL) + alarm->seconds;
-          alarm_insert(alarm);
-          status = pthread_mutex_unlock(&alarm_mutex);
-          if (status != 0)
-            err_abort(status, "Unlock mutex");
-          printf("Type C Cancel Alarm Request With Message Number %d Inserted Into Alarm List at %lld: %c", alarm->messageNumber, (long long)time(NULL), alarm->type);
-        }
-        else{
-          free(alarm);
-        }
+    case 'c':
+      if (parse_seconds(optarg, &coalesce) == NULL)
+      {
+        fprintf(stderr, "Bad coalescing window \"%s\"\n", optarg);
+        exit(1);
       }
       break;
-    case 'D':
-      if (sscanf(line, "Pause_Thread: MessageType(%d)", &alarm->messageType) < 1)
-      {
-        alarm->type = 'D';
-        alarm_t **last, *next;
-        bool shouldProceed = true;
-
-        last = &alarm_list;
-        next = *last;
-        while(next != NULL){
-          if ( next->type == 'A' && next->messageType != alarm->messageType){
-            printf("Type D Alarm Request Error: No Alarm Request With Message Type %d!", alarm->messageType);
-            shouldProceed = false;
-            break;
-          }
-        }
-        last = &alarm_list;
-        next = *last;
-        while(next != NULL){
-          if ( next->type == 'B' && next->messageNumber == alarm->messageNumber){
-            printf("Error: More Than One Type D Alarm Request With Message Type %d!", alarm->messageType);
-            shouldProceed = false;
-            break;
-          }
-        }
-        if (shouldProceed){
-          status = pthread_mutex_lock(&alarm_mutex);
-          if (status != 0)
-            err_abort(status, "Lock mutex");
-          alarm->time = time(NULL) + alarm->seconds;
-          alarm_insert(alarm);
-          status = pthread_mutex_unlock(&alarm_mutex);
-          if (status != 0)
-            err_abort(status, "Unlock mutex");
-          printf("Type D Pause Thread Alarm Request For Message Type %d Inserted Into Alarm List at %lld!", alarm->messageType, (long long)time(NULL));
-        }
-        else{
-          free(alarm);
-        }
+    case 'j':
+      shard_count = atoi(optarg);
+      if (shard_count < 1 || shard_count > SHARD_MAX)
+      {
+        fprintf(stderr, "Bad shard count \"%s\"\n", optarg);
+        exit(1);
       }
       break;
-    case 'E':
-      if (sscanf(line, "Resume_Thread: MessageType(%d)", &alarm->messageType) < 1)
-      {
-        alarm->type = 'E';
-        alarm_t **last, *next;
-        bool shouldProceed = true;
-
-        last = &alarm_list;
-        next = *last;
-        while(next != NULL){
-          if ( next->type == 'D' && next->messageType != alarm->messageType){
-            printf("Type E Alarm Request Error: No Type D Pause Alarm Request With Message Type %d!", alarm->messageType);
-            shouldProceed = false;
-            break;
-          }
-        }
-        last = &alarm_list;
-        next = *last;
-        while(next != NULL){
-          if ( next->type == 'E' && next->messageNumber == alarm->messageNumber){
-            printf("Error: More Than One Type E Alarm Request With Message Type %d!", alarm->messageType);
-            shouldProceed = false;
-            break;
-          }
-        }
-        if (shouldProceed){
-          status = pthread_mutex_lock(&alarm_mutex);
-          if (status != 0)
-            err_abort(status, "Lock mutex");
-          alarm->time = time(NULL) + alarm->seconds;
-          alarm_insert(alarm);
-          status = pthread_mutex_unlock(&alarm_mutex);
-          if (status != 0)
-            err_abort(status, "Unlock mutex");
-          printf("Type E Resume Thread Alarm Request For Message Type %d Inserted Into Alarm List at %lld!", alarm->messageType, (long long)time(NULL));
-        }
-        else{
-          free(alarm);
-        }
+    case 'l':
+      listen_fd = server_listen(optarg);
+      break;
+    case 'm':
+      admit_limit = atol(optarg);
+      if (admit_limit < 1)
+      {
+        fprintf(stderr, "Bad alarm limit \"%s\"\n", optarg);
+        exit(1);
       }
       break;
-    default:
-      printf("bad command\n");
+    case 'M':
+      admit_byte_limit = atol(optarg);
+      if (admit_byte_limit < 1)
+      {
+        fprintf(stderr, "Bad message byte limit \"%s\"\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'n':
+      count = atoi(optarg);
+      if (count <= 0)
+      {
+        fprintf(stderr, "Bad benchmark count \"%s\"\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'd':
+      dir = optarg;
+      break;
+    case 'f':
+      if (strcmp(optarg, "-") == 0)
+        fd = 0;
+      else if ((fd = open(optarg, O_RDONLY)) < 0)
+        errno_abort("Open command file");
+      break;
+    case 'o':
+      if (strcmp(optarg, "block") == 0)
+        log_drop = false;
+      else if (strcmp(optarg, "drop") == 0)
+        log_drop = true;
+      else
+      {
+        fprintf(stderr, "Unknown output policy \"%s\"\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'S':
+      if (parse_seconds(optarg, &stats_period) == NULL || stats_period == 0)
+      {
+        fprintf(stderr, "Bad stats period \"%s\"\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'v':
+      verbose = true;
+      break;
+    case 'p':
+      if (!place_init(optarg))
+      {
+        fprintf(stderr, "Bad CPU list \"%s\"\n", optarg);
+        exit(1);
+      }
+      break;
+    case 't':
+      for (i = 0; clock_sources[i] != NULL; i++)
+        if (strcmp(optarg, clock_sources[i]->name) == 0)
+          break;
+      if (clock_sources[i] == NULL)
+      {
+        fprintf(stderr, "Unknown clock \"%s\"\n", optarg);
+        exit(1);
+      }
+      clock_choose(clock_sources[i]);
+      break;
+    case 'w':
+      if (strcmp(optarg, "cond") == 0)
+        wait_epoll = false;
+      else if (strcmp(optarg, "epoll") == 0)
+        wait_epoll = true;
+      else
+      {
+        fprintf(stderr, "Unknown wait \"%s\"\n", optarg);
+        exit(1);
+      }
       break;
+    default:
+      fprintf(stderr, "Usage: %s [-b heap|wheel] [-j shards] [-p cpus] [-w cond|epoll] [-t real|virtual] [-c seconds]\n"
+                      "       %*s [-d directory] [-f file] [-l address] [-m alarms] [-M bytes]\n"
+                      "       %*s [-a block|reject|evict] [-o block|drop] [-S seconds] [-v]\n"
+                      "       %s [-b heap|wheel] [-j shards] [-p cpus] [-w cond|epoll] [-t real|virtual] -B workload [-n count]\n",
+              argv[0], (int)strlen(argv[0]), "", (int)strlen(argv[0]), "", argv[0]);
+      exit(1);
+    }
+  }
+  if (clock_source->skip != NULL && (dir != NULL || listen_fd >= 0))
+  {
+    fprintf(stderr, "-t virtual cannot be used with -d or -l\n");
+    exit(1);
+  }
+  if (clock_source->skip != NULL && fd < 0 && workload == NULL)
+  {
+    fprintf(stderr, "-t virtual needs -f or -B\n");
+    exit(1);
+  }
+
+  /*
+   * Without "-b", a benchmark is run once in a child process for
+   * each backend, before any thread has been created.
+   */
+  if (workload != NULL && !backend)
+  {
+    for (i = 0; sched_backends[i] != NULL; i++)
+    {
+      fflush(stdout);
+      child = fork();
+      if (child < 0)
+        errno_abort("Fork");
+      if (child == 0)
+      {
+        sched_choose(sched_backends[i]);
+        break;
+      }
+      if (waitpid(child, &status, 0) < 0)
+        errno_abort("Wait for benchmark");
+    }
+    if (sched_backends[i] == NULL)
+      exit(0);
+  }
+
+  /*
+   * Time the condition wait on CLOCK_MONOTONIC, the clock that
+   * alarm times are read from.
+   */
+  status = pthread_condattr_init(&cond_attr);
+  if (status != 0)
+    err_abort(status, "Init cond attr");
+  status = pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  if (status != 0)
+    err_abort(status, "Set cond clock");
+  shards = malloc(shard_count * sizeof(shard_t *));
+  if (shards == NULL)
+    errno_abort("Allocate shards");
+  for (i = 0; i < shard_count; i++)
+    shards[i] = shard_create(i, &cond_attr);
+  place_self(-1);
+
+  keyword_init();
+  pool_init();
+  intern_init();
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+  status = pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  if (status != 0)
+    err_abort(status, "Block SIGUSR1");
+  log_init();
+  if (dir != NULL)
+    durable_open(dir);
+  for (i = 0; i < shard_count; i++)
+  {
+    status = pthread_create(
+        &shards[i]->thread, place_attr(shards[i]->cpu), alarm_thread, shards[i]);
+    if (status != 0)
+      err_abort(status, "Create alarm thread");
+  }
+  status = pthread_create(&thread, NULL, signal_thread, &signals);
+  if (status != 0)
+    err_abort(status, "Create signal thread");
+  if (listen_fd >= 0)
+  {
+    status = pthread_create(&server, NULL, server_thread, (void *)(intptr_t)listen_fd);
+    if (status != 0)
+      err_abort(status, "Create server thread");
+  }
+  if (workload != NULL)
+  {
+    log_quiet = true;
+    bench_run(workload, count);
+    exit(0);
+  }
+  /*
+   * With a server, the end of the input only ends the input; the
+   * clients keep the program running.
+   */
+  if (fd >= 0)
+  {
+    stream_commands(fd);
+    if (listen_fd >= 0)
+      pthread_join(server, NULL);
+    wait_idle(true);
+    worker_drain();
+    log_flush();
+    if (verbose)
+      wake_stats_print();
+    exit(0);
+  }
+  while (1)
+  {
+    log_printf("Alarm> ");
+    if (fgets(line, sizeof(line), stdin) == NULL)
+    {
+      if (listen_fd >= 0)
+        pthread_join(server, NULL);
+      /*
+       * What was typed is only kept once it has been carried out.
+       */
+      if (dir != NULL)
+        wait_idle(false);
+      worker_drain();
+      log_flush();
+      if (verbose)
+        wake_stats_print();
+      exit(0);
     }
+    if (strlen(line) <= 1)
+      continue;
+
+    /*
+     * A command is only allocated once its line has been parsed;
+     * it is then handed to the alarm thread to be carried out.
+     */
+    if (!command_parse(line, &command))
+      fprintf(stderr, "Bad command\n");
+    else if (alarm_admit(request = command_alarm(&command), NULL))
+      alarm_submit(request);
 
     //    /*
     //     * Parse input line into seconds (%d) and a message